@@ -25,6 +25,7 @@
 #include "knot_types.h"
 
 static GMainLoop *main_loop;
+static guint timeout_id;
 static int32_t speed_value = 0;
 
 static void sig_term(int sig)
@@ -50,9 +51,17 @@ static int speed_write(int32_t *val, int32_t *multiplier)
 
 static gboolean loop(gpointer user_data)
 {
-	knot_thing_run();
+	int32_t delay = knot_thing_run();
 
-	return TRUE;
+	if (delay < 0) {
+		timeout_id = 0;
+		return FALSE;
+	}
+
+	/* Called again only when the thing has work to do */
+	timeout_id = g_timeout_add(delay, loop, NULL);
+
+	return FALSE;
 }
 
 #define SPEED_SENSOR_ID		3
@@ -66,7 +75,7 @@ int main(int argc, char *argv[])
 	 * read/write callbacks.
 	 */
 
-	int err, timeout_id;
+	int err;
 
 	knot_data_functions functions;
 	functions.int_f.read = speed_read;
@@ -94,12 +103,13 @@ int main(int argc, char *argv[])
 	knot_thing_config_data_item(SPEED_SENSOR_ID, (KNOT_EVT_FLAG_LOWER_THRESHOLD|KNOT_EVT_FLAG_UPPER_THRESHOLD), 
 	&lower_limit, &upper_limit);
 
-	/* Calls loop() each 1 seconds: simulates Arduino loop function */
-	timeout_id = g_timeout_add_seconds(1, loop, NULL);
+	/* Simulates Arduino loop function, rearmed by loop() itself */
+	timeout_id = g_timeout_add(0, loop, NULL);
 
 	g_main_loop_run(main_loop);
 
-	g_source_remove(timeout_id);
+	if (timeout_id)
+		g_source_remove(timeout_id);
 
 	g_main_loop_unref(main_loop);
 
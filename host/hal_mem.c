@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "include/comm.h"
+#include "include/storage.h"
+#include "include/time.h"
+
+#include "hal_mem.h"
+
+#define HAL_MEM_SOCK			1
+#define HAL_MEM_CLI_SOCK		2
+#define HAL_MEM_STORAGE_IDS		8
+#define HAL_MEM_STORAGE_LEN		64
+#define HAL_MEM_EEPROM_SIZE		1024
+
+static struct {
+	uint8_t frame[HAL_MEM_FRAME_MAX];
+	uint8_t len;
+} rx_queue[HAL_MEM_RX_QUEUE_LEN];
+static uint8_t rx_head, rx_count;
+
+static struct {
+	uint8_t value[HAL_MEM_STORAGE_LEN];
+	uint16_t len;
+} storage[HAL_MEM_STORAGE_IDS];
+
+/* Address based storage, erased as a new EEPROM */
+static uint8_t eeprom[HAL_MEM_EEPROM_SIZE];
+
+static hal_mem_peer_function peerf;
+static uint32_t now_ms;
+static uint32_t write_failures;
+static int write_error;
+static uint32_t random_state = 0x2545f491;
+
+void hal_mem_reset(void)
+{
+	rx_head = 0;
+	rx_count = 0;
+	peerf = NULL;
+	now_ms = 0;
+	write_failures = 0;
+	random_state = 0x2545f491;
+	memset(storage, 0, sizeof(storage));
+	memset(eeprom, 0xff, sizeof(eeprom));
+}
+
+void hal_mem_set_peer(hal_mem_peer_function peer)
+{
+	peerf = peer;
+}
+
+int hal_mem_rx_push(const void *frame, size_t len)
+{
+	uint8_t tail;
+
+	if (len > HAL_MEM_FRAME_MAX || rx_count == HAL_MEM_RX_QUEUE_LEN)
+		return -ENOBUFS;
+
+	tail = (rx_head + rx_count) % HAL_MEM_RX_QUEUE_LEN;
+	memcpy(rx_queue[tail].frame, frame, len);
+	rx_queue[tail].len = len;
+	rx_count++;
+
+	return 0;
+}
+
+void hal_mem_fail_writes(uint32_t count, int err)
+{
+	write_failures = count;
+	write_error = err;
+}
+
+void hal_mem_time_advance(uint32_t ms)
+{
+	now_ms += ms;
+}
+
+/* Comm */
+
+int hal_comm_init(const char *pathname)
+{
+	return 0;
+}
+
+int hal_comm_deinit(void)
+{
+	return 0;
+}
+
+int hal_comm_socket(int domain, int protocol)
+{
+	return HAL_MEM_SOCK;
+}
+
+void hal_comm_close(int sockfd)
+{
+
+}
+
+int hal_comm_listen(int sockfd)
+{
+	return 0;
+}
+
+int hal_comm_accept(int sockfd, uint64_t *addr)
+{
+	return HAL_MEM_CLI_SOCK;
+}
+
+int hal_comm_connect(int sockfd, uint64_t *addr)
+{
+	return 0;
+}
+
+ssize_t hal_comm_read(int sockfd, void *buffer, size_t count)
+{
+	size_t len;
+
+	if (rx_count == 0)
+		return -EAGAIN;
+
+	len = rx_queue[rx_head].len;
+	if (len > count)
+		len = count;
+
+	memcpy(buffer, rx_queue[rx_head].frame, len);
+	rx_head = (rx_head + 1) % HAL_MEM_RX_QUEUE_LEN;
+	rx_count--;
+
+	return len;
+}
+
+ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count)
+{
+	if (write_failures > 0) {
+		write_failures--;
+		return write_error;
+	}
+
+	if (peerf)
+		peerf(buffer, count);
+
+	return count;
+}
+
+/* Storage */
+
+ssize_t hal_storage_read(uint16_t addr, uint8_t *value, uint16_t len)
+{
+	if ((uint32_t) addr + len > sizeof(eeprom))
+		return -EINVAL;
+
+	memcpy(value, eeprom + addr, len);
+
+	return len;
+}
+
+ssize_t hal_storage_write(uint16_t addr, const uint8_t *value, uint16_t len)
+{
+	if ((uint32_t) addr + len > sizeof(eeprom))
+		return -EINVAL;
+
+	memcpy(eeprom + addr, value, len);
+
+	return len;
+}
+
+ssize_t hal_storage_read_end(uint8_t id, void *value, uint16_t len)
+{
+	if (id >= HAL_MEM_STORAGE_IDS)
+		return -EINVAL;
+
+	if (len > storage[id].len)
+		len = storage[id].len;
+
+	memcpy(value, storage[id].value, len);
+
+	return len;
+}
+
+ssize_t hal_storage_write_end(uint8_t id, void *value, uint16_t len)
+{
+	if (id >= HAL_MEM_STORAGE_IDS || len > HAL_MEM_STORAGE_LEN)
+		return -EINVAL;
+
+	memcpy(storage[id].value, value, len);
+	storage[id].len = len;
+
+	return len;
+}
+
+void hal_storage_reset_end(void)
+{
+	memset(storage, 0, sizeof(storage));
+}
+
+/* Time */
+
+uint32_t hal_time_ms(void)
+{
+	return now_ms;
+}
+
+uint32_t hal_time_us(void)
+{
+	return now_ms * 1000;
+}
+
+void hal_delay_ms(uint32_t ms)
+{
+	now_ms += ms;
+}
+
+void hal_delay_us(uint32_t us)
+{
+	now_ms += us / 1000;
+}
+
+/* Random: xorshift32, deterministic so benchmark runs are comparable */
+
+int hal_getrandom(void *buf, size_t buflen)
+{
+	uint8_t *p = buf;
+
+	while (buflen--) {
+		random_state ^= random_state << 13;
+		random_state ^= random_state >> 17;
+		random_state ^= random_state << 5;
+		*p++ = random_state;
+	}
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * In-memory stand-ins for the KNoT HAL (comm, storage, time and random)
+ * used by the host (Linux) builds. Frames written by the thing are handed
+ * to an optional peer callback, which plays the gateway role and may push
+ * answers back to the thing receive queue.
+ */
+
+#ifndef __HAL_MEM_H__
+#define __HAL_MEM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HAL_MEM_FRAME_MAX		128
+#define HAL_MEM_RX_QUEUE_LEN		16
+
+typedef void (*hal_mem_peer_function)(const void *frame, size_t len);
+
+void hal_mem_reset(void);
+void hal_mem_set_peer(hal_mem_peer_function peer);
+int hal_mem_rx_push(const void *frame, size_t len);
+
+/* The next 'count' hal_comm_write() calls fail with 'err' (e.g. -EAGAIN) */
+void hal_mem_fail_writes(uint32_t count, int err);
+
+void hal_mem_time_advance(uint32_t ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_MEM_H__ */
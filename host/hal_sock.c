@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "include/comm.h"
+#include "include/storage.h"
+#include "include/time.h"
+
+#include "hal_sock.h"
+
+static struct sockaddr_un gw_addr;
+static struct hal_sock_stats stats;
+static uint32_t random_state;
+
+void hal_sock_set_path(const char *path)
+{
+	memset(&gw_addr, 0, sizeof(gw_addr));
+	gw_addr.sun_family = AF_UNIX;
+	strncpy(gw_addr.sun_path, path, sizeof(gw_addr.sun_path) - 1);
+}
+
+const struct hal_sock_stats *hal_sock_get_stats(void)
+{
+	return &stats;
+}
+
+static int sock_open(void)
+{
+	int sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+							SOCK_CLOEXEC, 0);
+
+	if (sockfd < 0)
+		return -errno;
+
+	return sockfd;
+}
+
+/* Comm */
+
+int hal_comm_init(const char *pathname)
+{
+	return 0;
+}
+
+int hal_comm_deinit(void)
+{
+	return 0;
+}
+
+/* Only a handle: the link itself is set up by hal_comm_accept() */
+int hal_comm_socket(int domain, int protocol)
+{
+	return sock_open();
+}
+
+void hal_comm_close(int sockfd)
+{
+	if (sockfd >= 0)
+		close(sockfd);
+}
+
+int hal_comm_listen(int sockfd)
+{
+	return 0;
+}
+
+/*
+ * The gateway connecting to the thing is played by the thing connecting
+ * to the gateway. A gateway that is not listening yet or has its backlog
+ * full is not in range: -EAGAIN, as the radio does.
+ */
+int hal_comm_accept(int sockfd, uint64_t *addr)
+{
+	int cli_sock = sock_open();
+
+	if (cli_sock < 0)
+		return cli_sock;
+
+	if (connect(cli_sock, (struct sockaddr *) &gw_addr,
+						sizeof(gw_addr)) < 0) {
+		int err = errno;
+
+		close(cli_sock);
+		if (err == EAGAIN || err == ECONNREFUSED || err == ENOENT) {
+			stats.connect_retries++;
+			return -EAGAIN;
+		}
+
+		return -err;
+	}
+
+	stats.connects++;
+
+	return cli_sock;
+}
+
+int hal_comm_connect(int sockfd, uint64_t *addr)
+{
+	return -ENOSYS;
+}
+
+ssize_t hal_comm_read(int sockfd, void *buffer, size_t count)
+{
+	ssize_t len;
+
+	stats.comm_reads++;
+
+	len = recv(sockfd, buffer, count, MSG_DONTWAIT);
+	if (len < 0)
+		return (errno == EWOULDBLOCK ? -EAGAIN : -errno);
+
+	/* Gateway closed the link */
+	if (len == 0)
+		return -ENOTCONN;
+
+	return len;
+}
+
+ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count)
+{
+	ssize_t len;
+
+	len = send(sockfd, buffer, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			stats.comm_write_eagain++;
+			return -EAGAIN;
+		}
+
+		stats.comm_write_errors++;
+		return -errno;
+	}
+
+	stats.comm_writes++;
+	stats.comm_tx_bytes += len;
+
+	return len;
+}
+
+/* Storage: shared by every thing of the process, so not backed at all */
+
+ssize_t hal_storage_read(uint16_t addr, uint8_t *value, uint16_t len)
+{
+	return -ENOSYS;
+}
+
+ssize_t hal_storage_write(uint16_t addr, const uint8_t *value, uint16_t len)
+{
+	return -ENOSYS;
+}
+
+ssize_t hal_storage_read_end(uint8_t id, void *value, uint16_t len)
+{
+	return 0;
+}
+
+ssize_t hal_storage_write_end(uint8_t id, void *value, uint16_t len)
+{
+	return -ENOSYS;
+}
+
+void hal_storage_reset_end(void)
+{
+
+}
+
+/* Time */
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t hal_time_ms(void)
+{
+	return monotonic_us() / 1000;
+}
+
+uint32_t hal_time_us(void)
+{
+	return monotonic_us();
+}
+
+void hal_delay_ms(uint32_t ms)
+{
+	usleep(ms * 1000);
+}
+
+void hal_delay_us(uint32_t us)
+{
+	usleep(us);
+}
+
+/* Random: xorshift32, seeded once per process */
+
+int hal_getrandom(void *buf, size_t buflen)
+{
+	uint8_t *p = buf;
+
+	if (random_state == 0)
+		random_state = (monotonic_us() ^ getpid()) | 1;
+
+	while (buflen--) {
+		random_state ^= random_state << 13;
+		random_state ^= random_state >> 17;
+		random_state ^= random_state << 5;
+		*p++ = random_state;
+	}
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * KNoT HAL over local sockets, used by the host (Linux) load generator.
+ * Every hal_comm_accept() connects a new AF_UNIX SOCK_SEQPACKET socket to
+ * the gateway listening on the path set by hal_sock_set_path(), so each
+ * thing hosted by the process gets its own link and frame boundaries are
+ * kept as on the radio. Time is the monotonic clock. Storage is not
+ * backed: things must be created with KNOT_THING_NO_STORAGE.
+ */
+
+#ifndef __HAL_SOCK_H__
+#define __HAL_SOCK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct hal_sock_stats {
+	uint32_t connects;
+	uint32_t connect_retries;	// Gateway not there or backlog full
+	uint32_t comm_reads;
+	uint32_t comm_writes;
+	uint32_t comm_write_eagain;	// Socket buffer full: backpressure
+	uint32_t comm_write_errors;
+	uint64_t comm_tx_bytes;
+};
+
+void hal_sock_set_path(const char *path);
+
+const struct hal_sock_stats *hal_sock_get_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_SOCK_H__ */
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Host microbenchmarks for the KNoT Thing hot paths.
+ *
+ * Build and run:
+ *	make bench
+ *	./build/host/knot_bench [iterations]
+ *
+ * Reports ns/call and heap allocations/call of knot_thing_protocol_run(),
+ * verify_events(), data_item_read() and knot_thing_create_schema() for
+ * every value type and for 1 up to KNOT_THING_DATA_MAX registered items.
+ * The HAL is replaced by the in-memory stand-ins of hal_mem.c, so the
+ * numbers measure the thing library alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "knot_thing_config.h"
+#include "knot_types.h"
+#include "knot_thing_main.h"
+#include "hal_mem.h"
+
+#define BENCH_DEFAULT_ITERATIONS	200000
+
+/* Not exported by knot_thing_main.h */
+int knot_thing_config_data_item(uint8_t sensor_id, uint8_t event_flags,
+	knot_value_types *lower_limit, knot_value_types *upper_limit);
+int knot_thing_create_schema(uint8_t i, knot_msg_schema *msg);
+int verify_events(knot_msg_data *data);
+
+/*
+ * Heap accounting: the binary is linked with --wrap for the allocator
+ * entry points, so any allocation done by the library is counted.
+ */
+static uint32_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+/*
+ * data_item_read() is static to knot_thing_main.c: grab it, and the
+ * protocol context it takes, on their way to the protocol layer.
+ */
+static struct knot_thing_protocol *item_proto;
+static data_function item_read;
+
+int __real_knot_thing_protocol_init(struct knot_thing_protocol *proto,
+	const char *thing_name, uint8_t flags, data_function read,
+	data_function write, schema_function schema, config_function config,
+	events_function event, encode_function encode,
+	fingerprint_function fingerprint, next_function next,
+	diag_function diag, stream_function stream);
+
+int __wrap_knot_thing_protocol_init(struct knot_thing_protocol *proto,
+	const char *thing_name, uint8_t flags, data_function read,
+	data_function write, schema_function schema, config_function config,
+	events_function event, encode_function encode,
+	fingerprint_function fingerprint, next_function next,
+	diag_function diag, stream_function stream)
+{
+	item_proto = proto;
+	item_read = read;
+
+	return __real_knot_thing_protocol_init(proto, thing_name, flags, read,
+			write, schema, config, event, encode, fingerprint,
+			next, diag, stream);
+}
+
+/* Sensor callbacks: values move on every read so events keep firing */
+static int32_t counter;
+
+static int int_read(int32_t *val, int32_t *multiplier)
+{
+	*val = counter++;
+	*multiplier = 1;
+	return 0;
+}
+
+static int float_read(int32_t *val_int, uint32_t *val_dec, int32_t *multiplier)
+{
+	*val_int = counter++;
+	*val_dec = 5;
+	*multiplier = 1;
+	return 0;
+}
+
+static int bool_read(uint8_t *val)
+{
+	*val = (counter++) & 0x01;
+	return 0;
+}
+
+static int raw_read(uint8_t *val, uint8_t *len)
+{
+	memset(val, (uint8_t) counter++, KNOT_DATA_RAW_SIZE);
+	*len = KNOT_DATA_RAW_SIZE;
+	return 0;
+}
+
+static uint8_t raw_buffers[KNOT_THING_DATA_MAX][KNOT_DATA_RAW_SIZE];
+
+/*
+ * Gateway stand-in: registers the thing, accepts authentication and acks
+ * every schema
+ */
+static void gateway(const void *frame, size_t len)
+{
+	const knot_msg_header *hdr = frame;
+	knot_msg_credential crdntl;
+	knot_msg_result resp;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.hdr.payload_len = sizeof(resp.result);
+	resp.result = KNOT_SUCCESS;
+
+	switch (hdr->type) {
+	case KNOT_MSG_REGISTER_REQ:
+		memset(&crdntl, 0, sizeof(crdntl));
+		crdntl.hdr.type = KNOT_MSG_REGISTER_RESP;
+		crdntl.hdr.payload_len = sizeof(crdntl) - sizeof(crdntl.hdr);
+		crdntl.result = KNOT_SUCCESS;
+		memcpy(crdntl.uuid, "00000000-0000-0000-0000-000000000000",
+							sizeof(crdntl.uuid));
+		memset(crdntl.token, 'a', sizeof(crdntl.token));
+		hal_mem_rx_push(&crdntl, sizeof(crdntl));
+		return;
+	case KNOT_MSG_AUTH_REQ:
+		resp.hdr.type = KNOT_MSG_AUTH_RESP;
+		break;
+	case KNOT_MSG_SCHEMA:
+		resp.hdr.type = KNOT_MSG_SCHEMA_RESP;
+		break;
+	case KNOT_MSG_SCHEMA_END:
+		resp.hdr.type = KNOT_MSG_SCHEMA_END_RESP;
+		break;
+	default:
+		return;
+	}
+
+	hal_mem_rx_push(&resp, sizeof(resp.hdr) + resp.hdr.payload_len);
+}
+
+static const char *type_name(uint8_t value_type)
+{
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		return "int";
+	case KNOT_VALUE_TYPE_FLOAT:
+		return "float";
+	case KNOT_VALUE_TYPE_BOOL:
+		return "bool";
+	case KNOT_VALUE_TYPE_RAW:
+		return "raw";
+	default:
+		return "?";
+	}
+}
+
+static int setup(uint8_t value_type, uint8_t items)
+{
+	knot_data_functions func;
+	struct knot_thing_stats stats;
+	uint8_t id;
+	int err;
+
+	hal_mem_reset();
+	hal_mem_set_peer(gateway);
+
+	if (knot_thing_init("bench") < 0)
+		return -1;
+
+	memset(&func, 0, sizeof(func));
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		func.int_f.read = int_read;
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		func.float_f.read = float_read;
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		func.bool_f.read = bool_read;
+		break;
+	case KNOT_VALUE_TYPE_RAW:
+		func.raw_f.read = raw_read;
+		break;
+	}
+
+	for (id = 0; id < items; id++) {
+		if (value_type == KNOT_VALUE_TYPE_RAW)
+			err = knot_thing_register_raw_data_item(id, "bench",
+					raw_buffers[id], KNOT_DATA_RAW_SIZE,
+					KNOT_TYPE_ID_NONE, value_type,
+					KNOT_UNIT_NOT_APPLICABLE, &func);
+		else
+			err = knot_thing_register_data_item(id, "bench",
+					KNOT_TYPE_ID_NONE, value_type,
+					KNOT_UNIT_NOT_APPLICABLE, &func);
+		if (err < 0)
+			return -1;
+
+		knot_thing_config_data_item(id, KNOT_EVT_FLAG_CHANGE |
+						KNOT_EVT_FLAG_TIME, NULL, NULL);
+	}
+
+	/* Walk the state machine up to STATE_ONLINE */
+	for (id = 0; id < 32; id++) {
+		knot_thing_run();
+		knot_thing_get_stats(&stats);
+		if (stats.proto.state == KNOT_THING_STATE_ONLINE)
+			return 0;
+	}
+
+	return -1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *func, uint8_t value_type, uint8_t items,
+			uint32_t iterations, uint64_t elapsed, uint32_t nallocs)
+{
+	printf("%-26s %-6s %5u %12.1f %12.3f\n", func, type_name(value_type),
+		items, (double) elapsed / iterations,
+		(double) nallocs / iterations);
+}
+
+#define BENCH(_name, _type, _items, _iterations, _call)			\
+	do {								\
+		uint32_t _i, _allocs = allocs;				\
+		uint64_t _start = now_ns();				\
+		for (_i = 0; _i < (_iterations); _i++) {		\
+			_call;						\
+		}							\
+		report(_name, _type, _items, _iterations,		\
+			now_ns() - _start, allocs - _allocs);		\
+	} while (0)
+
+int main(int argc, char *argv[])
+{
+	static const uint8_t types[] = { KNOT_VALUE_TYPE_INT,
+		KNOT_VALUE_TYPE_FLOAT, KNOT_VALUE_TYPE_BOOL,
+		KNOT_VALUE_TYPE_RAW };
+	uint32_t iterations = BENCH_DEFAULT_ITERATIONS;
+	knot_msg_schema schema;
+	knot_msg_data data;
+	uint8_t t, items;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+
+	if (iterations == 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-26s %-6s %5s %12s %12s\n", "function", "type", "items",
+						"ns/call", "allocs/call");
+
+	for (t = 0; t < sizeof(types); t++) {
+		for (items = 1; items <= KNOT_THING_DATA_MAX; items++) {
+			if (setup(types[t], items) < 0) {
+				fprintf(stderr, "setup failed: %s/%u\n",
+						type_name(types[t]), items);
+				return EXIT_FAILURE;
+			}
+
+			BENCH("knot_thing_protocol_run", types[t], items,
+				iterations, {
+					hal_mem_time_advance(1);
+					knot_thing_run();
+				});
+
+			BENCH("verify_events", types[t], items, iterations, {
+					hal_mem_time_advance(1);
+					memset(&data, 0, sizeof(data));
+					verify_events(&data);
+				});
+
+			BENCH("data_item_read", types[t], items, iterations,
+				item_read(item_proto, _i % items, &data));
+
+			BENCH("knot_thing_create_schema", types[t], items,
+				iterations, {
+					memset(&schema, 0, sizeof(schema));
+					knot_thing_create_schema(_i % items,
+								&schema);
+				});
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
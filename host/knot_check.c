@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Host checks of the KNoT Thing event logic.
+ *
+ * Build and run:
+ *	make check
+ *
+ * Drives the default thing over the in-memory HAL stand-ins of hal_mem.c
+ * and checks which samples are reported. Exits with the number of checks
+ * that failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "knot_thing_config.h"
+#include "knot_types.h"
+#include "knot_thing_main.h"
+#include "hal_mem.h"
+
+/* Not exported by knot_thing_main.h */
+int knot_thing_config_data_item(uint8_t sensor_id, uint8_t event_flags,
+	knot_value_types *lower_limit, knot_value_types *upper_limit);
+int verify_events(knot_msg_data *data);
+
+static uint32_t failures;
+
+#define CHECK(_cond, _what)						\
+	do {								\
+		if (!(_cond)) {						\
+			printf("FAIL %s:%d: %s\n", __func__, __LINE__,	\
+								_what);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+/* Sensor stand-in: returns whatever the check set last */
+static int32_t sensor_value, sensor_multiplier;
+static uint32_t sensor_dec;
+
+static int int_read(int32_t *val, int32_t *multiplier)
+{
+	*val = sensor_value;
+	*multiplier = sensor_multiplier;
+	return 0;
+}
+
+static int float_read(int32_t *val_int, uint32_t *val_dec, int32_t *multiplier)
+{
+	*val_int = sensor_value;
+	*val_dec = sensor_dec;
+	*multiplier = sensor_multiplier;
+	return 0;
+}
+
+/*
+ * Gateway stand-in: accepts the thing, acks its schema and keeps the last
+ * int reading. The first schema frame makes the next gw_fail_count writes
+ * fail with gw_fail_err.
+ */
+static uint32_t gw_schemas, gw_datas, gw_fail_count;
+static int32_t gw_value;
+static int gw_fail_err;
+
+static void gateway(const void *frame, size_t len)
+{
+	const knot_msg_header *hdr = frame;
+	knot_msg_credential crdntl;
+	knot_msg_result resp;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.hdr.payload_len = sizeof(resp.result);
+	resp.result = KNOT_SUCCESS;
+
+	switch (hdr->type) {
+	case KNOT_MSG_REGISTER_REQ:
+		memset(&crdntl, 0, sizeof(crdntl));
+		crdntl.hdr.type = KNOT_MSG_REGISTER_RESP;
+		crdntl.hdr.payload_len = sizeof(crdntl) - sizeof(crdntl.hdr);
+		crdntl.result = KNOT_SUCCESS;
+		memcpy(crdntl.uuid, "00000000-0000-0000-0000-000000000000",
+							sizeof(crdntl.uuid));
+		memset(crdntl.token, 'a', sizeof(crdntl.token));
+		hal_mem_rx_push(&crdntl, sizeof(crdntl));
+		return;
+	case KNOT_MSG_DATA:
+		gw_value = ((const knot_msg_data *) frame)->
+						payload.values.val_i.value;
+		gw_datas++;
+		return;
+	case KNOT_MSG_AUTH_REQ:
+		resp.hdr.type = KNOT_MSG_AUTH_RESP;
+		break;
+	case KNOT_MSG_SCHEMA:
+		if (gw_schemas++ == 0 && gw_fail_count)
+			hal_mem_fail_writes(gw_fail_count, gw_fail_err);
+
+		resp.hdr.type = KNOT_MSG_SCHEMA_RESP;
+		break;
+	case KNOT_MSG_SCHEMA_END:
+		gw_schemas++;
+		resp.hdr.type = KNOT_MSG_SCHEMA_END_RESP;
+		break;
+	default:
+		return;
+	}
+
+	hal_mem_rx_push(&resp, sizeof(resp.hdr) + resp.hdr.payload_len);
+}
+
+/* Runs the thing, at most 'runs' times, until it is online: 0 if it is */
+static int run_online(uint32_t runs)
+{
+	struct knot_thing_stats stats;
+	int32_t delay;
+
+	while (runs--) {
+		delay = knot_thing_run();
+		if (delay < 0)
+			return -1;
+
+		hal_mem_time_advance(delay);
+		knot_thing_get_stats(&stats);
+		if (stats.proto.state == KNOT_THING_STATE_ONLINE)
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Samples the item with this reading: 1 if it is reported */
+static int sample(int32_t value, uint32_t dec, int32_t multiplier)
+{
+	knot_msg_data data;
+
+	sensor_value = value;
+	sensor_dec = dec;
+	sensor_multiplier = multiplier;
+
+	hal_mem_time_advance(KNOT_THING_POLL_MS);
+	memset(&data, 0, sizeof(data));
+
+	return (verify_events(&data) == 0);
+}
+
+static int setup(uint8_t value_type, knot_data_functions *func)
+{
+	hal_mem_reset();
+	hal_mem_set_peer(gateway);
+	gw_schemas = 0;
+	gw_datas = 0;
+	gw_fail_count = 0;
+
+	if (knot_thing_init("check") < 0)
+		return -1;
+
+	return knot_thing_register_data_item(1, "check", KNOT_TYPE_ID_NONE,
+				value_type, KNOT_UNIT_NOT_APPLICABLE, func);
+}
+
+/*
+ * Limits are configured once and must hold whatever multiplier the
+ * readings come with, however many times it changes
+ */
+static void check_limits_multiplier(void)
+{
+	knot_data_functions func;
+	knot_value_types lower, upper;
+	int i;
+
+	memset(&func, 0, sizeof(func));
+	func.int_f.read = int_read;
+	if (setup(KNOT_VALUE_TYPE_INT, &func) < 0) {
+		CHECK(0, "setup");
+		return;
+	}
+
+	memset(&lower, 0, sizeof(lower));
+	memset(&upper, 0, sizeof(upper));
+	lower.val_i.value = -15;
+	lower.val_i.multiplier = 1;
+	upper.val_i.value = 15;
+	upper.val_i.multiplier = 1;
+	CHECK(knot_thing_config_data_item(1, KNOT_EVT_FLAG_UPPER_THRESHOLD |
+		KNOT_EVT_FLAG_LOWER_THRESHOLD, &lower, &upper) == 0, "config");
+
+	CHECK(!sample(14, 0, 1), "14 is below 15");
+	for (i = 0; i < 3; i++) {
+		CHECK(sample(2, 0, 10), "2 x 10 crosses 15");
+		CHECK(!sample(1, 0, 10), "1 x 10 is below 15");
+		CHECK(!sample(14, 0, 1), "14 is still below 15");
+		CHECK(!sample(15, 0, 1), "15 is not above 15");
+		CHECK(sample(16, 0, 1), "16 crosses 15");
+		CHECK(!sample(-1, 0, 10), "-1 x 10 is above -15");
+		CHECK(sample(-2, 0, 10), "-2 x 10 crosses -15");
+		CHECK(!sample(-15, 0, 1), "-15 is not below -15");
+	}
+
+	/* The sign of the multiplier applies, as to the limits */
+	CHECK(sample(2, 0, -10), "2 x -10 crosses -15");
+	CHECK(!sample(-1, 0, -10), "-1 x -10 is below 15");
+	CHECK(sample(-2, 0, -10), "-2 x -10 crosses 15");
+}
+
+/* Same with decimals, which each multiplier scales differently */
+static void check_float_limits_multiplier(void)
+{
+	knot_data_functions func;
+	knot_value_types lower, upper;
+	int i;
+
+	memset(&func, 0, sizeof(func));
+	func.float_f.read = float_read;
+	if (setup(KNOT_VALUE_TYPE_FLOAT, &func) < 0) {
+		CHECK(0, "setup");
+		return;
+	}
+
+	memset(&lower, 0, sizeof(lower));
+	memset(&upper, 0, sizeof(upper));
+	lower.val_f.value_int = 0;
+	lower.val_f.multiplier = 1;
+	upper.val_f.value_int = 1;
+	upper.val_f.value_dec = 55;
+	upper.val_f.multiplier = 1;
+	CHECK(knot_thing_config_data_item(1, KNOT_EVT_FLAG_UPPER_THRESHOLD |
+		KNOT_EVT_FLAG_LOWER_THRESHOLD, &lower, &upper) == 0, "config");
+
+	for (i = 0; i < 3; i++) {
+		CHECK(!sample(1, 55, 1), "1.55 is not above 1.55");
+		CHECK(sample(1, 56, 1), "1.56 crosses 1.55");
+		CHECK(!sample(0, 15, 10), "0.15 x 10 is below 1.55");
+		CHECK(sample(0, 16, 10), "0.16 x 10 crosses 1.55");
+		CHECK(!sample(1, 54, 1), "1.54 is still below 1.55");
+	}
+}
+
+/* The change deadband holds across multipliers too */
+static void check_deadband_multiplier(void)
+{
+	knot_data_functions func;
+	knot_config_filter filter;
+
+	memset(&func, 0, sizeof(func));
+	func.int_f.read = int_read;
+	if (setup(KNOT_VALUE_TYPE_INT, &func) < 0) {
+		CHECK(0, "setup");
+		return;
+	}
+
+	memset(&filter, 0, sizeof(filter));
+	filter.deadband.val_i.value = 5;
+	filter.deadband.val_i.multiplier = 1;
+	CHECK(knot_thing_config_data_item_filter(1, &filter) == 0, "filter");
+	CHECK(knot_thing_config_data_item(1, KNOT_EVT_FLAG_CHANGE,
+						NULL, NULL) == 0, "config");
+
+	CHECK(sample(100, 0, 1), "first reading");
+	CHECK(!sample(10, 0, 10), "10 x 10 is 100");
+	CHECK(!sample(104, 0, 1), "104 is within 5 of 100");
+	CHECK(!sample(21, 0, 5), "21 x 5 is within 5 of 100");
+	CHECK(sample(11, 0, 10), "11 x 10 is 10 away from 100");
+	CHECK(!sample(106, 0, 1), "106 is within 5 of 110");
+	CHECK(sample(104, 0, 1), "104 is 6 away from 110");
+}
+
+/*
+ * A busy link while sending the schema is retried after a backoff: it is
+ * not an error, and no item is skipped
+ */
+static void check_schema_busy(void)
+{
+	knot_data_functions func;
+	struct knot_thing_stats stats;
+	uint8_t id;
+
+	memset(&func, 0, sizeof(func));
+	func.int_f.read = int_read;
+	if (setup(KNOT_VALUE_TYPE_INT, &func) < 0) {
+		CHECK(0, "setup");
+		return;
+	}
+
+	for (id = 2; id <= 3; id++)
+		CHECK(knot_thing_register_data_item(id, "check",
+				KNOT_TYPE_ID_NONE, KNOT_VALUE_TYPE_INT,
+				KNOT_UNIT_NOT_APPLICABLE, &func) == 0, "register");
+
+	gw_fail_count = 3;
+	gw_fail_err = -EAGAIN;
+	CHECK(run_online(64) == 0, "online");
+
+	knot_thing_get_stats(&stats);
+	CHECK(stats.proto.errors == 0, "no error");
+	CHECK(stats.proto.tx_busy == 3, "3 writes busy");
+	CHECK(gw_schemas == 3, "3 schemas");
+}
+
+/* Other link errors still go to STATE_ERROR */
+static void check_schema_error(void)
+{
+	knot_data_functions func;
+	struct knot_thing_stats stats;
+
+	memset(&func, 0, sizeof(func));
+	func.int_f.read = int_read;
+	if (setup(KNOT_VALUE_TYPE_INT, &func) < 0) {
+		CHECK(0, "setup");
+		return;
+	}
+
+	CHECK(knot_thing_register_data_item(2, "check", KNOT_TYPE_ID_NONE,
+				KNOT_VALUE_TYPE_INT, KNOT_UNIT_NOT_APPLICABLE,
+						&func) == 0, "register");
+
+	gw_fail_count = 1;
+	gw_fail_err = -EIO;
+	CHECK(run_online(64) == 0, "online");
+
+	knot_thing_get_stats(&stats);
+	CHECK(stats.proto.errors == 1, "1 error");
+	CHECK(stats.proto.last_error == -EIO, "-EIO");
+}
+
+/* Runs the thing once per sample period: 1 if it is still online */
+static int step(void)
+{
+	struct knot_thing_stats stats;
+
+	hal_mem_time_advance(KNOT_THING_POLL_MS);
+	knot_thing_run();
+	knot_thing_get_stats(&stats);
+
+	return (stats.proto.state == KNOT_THING_STATE_ONLINE);
+}
+
+/*
+ * Online, a busy link keeps the queued reading, which a newer one
+ * replaces, to send it once the link is back
+ */
+static void check_data_busy(void)
+{
+	knot_data_functions func;
+	struct knot_thing_stats before, after;
+
+	memset(&func, 0, sizeof(func));
+	func.int_f.read = int_read;
+	if (setup(KNOT_VALUE_TYPE_INT, &func) < 0) {
+		CHECK(0, "setup");
+		return;
+	}
+
+	CHECK(knot_thing_config_data_item(1, KNOT_EVT_FLAG_CHANGE,
+						NULL, NULL) == 0, "config");
+	sensor_value = 1;
+	sensor_multiplier = 1;
+	CHECK(run_online(64) == 0, "online");
+	CHECK(step() && gw_datas == 1 && gw_value == 1, "first reading");
+
+	knot_thing_get_stats(&before);
+	hal_mem_fail_writes(2, -EAGAIN);
+
+	sensor_value = 2;
+	CHECK(step(), "online, first write busy");
+	sensor_value = 3;
+	CHECK(step(), "online, second write busy");
+	CHECK(gw_datas == 1, "nothing sent while busy");
+
+	CHECK(step(), "online, link back");
+	CHECK(gw_datas == 2 && gw_value == 3, "newest reading sent");
+
+	knot_thing_get_stats(&after);
+	CHECK(after.proto.coalesced == before.proto.coalesced + 1,
+								"coalesced");
+	CHECK(after.proto.tx_busy == before.proto.tx_busy + 2, "2 busy");
+	CHECK(after.proto.state_changes == before.proto.state_changes,
+							"no state change");
+}
+
+int main(void)
+{
+	check_limits_multiplier();
+	check_float_limits_multiplier();
+	check_deadband_multiplier();
+	check_schema_busy();
+	check_schema_error();
+	check_data_busy();
+
+	printf("%s: %u failed\n", failures ? "FAIL" : "ok", failures);
+
+	return (failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}
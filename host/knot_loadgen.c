@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Many-thing load generator.
+ *
+ * Build and run:
+ *	make loadgen
+ *	./build/host/knot_loadgen [-n things] [-d seconds] [-s path]
+ *						[-b bytes] [-t trace.json]
+ *
+ * Hosts N things in one process, each one a knot_thing_ctx driven by the
+ * real knot_thing_protocol_run() state machine, with an int, a float, a
+ * bool and a raw synthetic sensor. They connect over AF_UNIX sockets (see
+ * hal_sock.c) to a gateway stand-in forked from the same binary, which
+ * registers the things, acks their schemas and counts the data frames
+ * received. At the end the gateway reports registrations/s, time to
+ * online percentiles (from the start of the run to the last schema ack
+ * sent, or to the auth of a thing whose schema is known) and the data
+ * frames/s sustained once every thing is online. With -b, each thing also
+ * has a stream item sending a compressible blob of that size over and
+ * over, which the gateway reassembles and checks (see knot_stream.h).
+ * With -t, the trace of the things is written to a Chrome trace file at
+ * the end (see knot_trace.h).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "knot_thing_config.h"
+#include "knot_types.h"
+#include "knot_thing_main.h"
+#include "hal_sock.h"
+#include "knot_trace.h"
+#include "knot_stream.h"
+
+#define LOADGEN_DEFAULT_THINGS		100
+#define LOADGEN_DEFAULT_SECONDS		10
+#define LOADGEN_DEFAULT_PATH		"/tmp/knot_loadgen.sock"
+#define LOADGEN_NAME			"load-%u"
+#define LOADGEN_FRAME_MAX		256
+#define LOADGEN_ITEMS			4
+#define LOADGEN_STREAM_ID		(LOADGEN_ITEMS + 1)
+
+/* Run start, on the monotonic clock shared by both processes */
+static uint64_t start_us;
+
+/* Size of the stream item blob, 0 if none */
+static uint32_t blob_size;
+
+/* Spectrum like: runs of slowly changing values */
+static uint8_t blob_byte(uint32_t offset)
+{
+	return (offset / 16) * 3;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Gateway stand-in
+ */
+
+struct gw_link {
+	int fd;
+	int32_t thing;			// Index from the device name, or -1
+	struct knot_stream_rx stream;
+};
+
+struct gw_thing {
+	uint8_t schema_known;
+	uint64_t online_us;		// 0 while not online yet
+};
+
+struct gw_stats {
+	uint32_t registrations;
+	uint64_t last_registration_us;
+	uint32_t online;
+	uint64_t last_online_us;
+	uint32_t schemas;
+	uint32_t data_frames;		// Since every thing is online
+	uint32_t data_bytes;
+	uint32_t resp_dropped;		// Thing not reading: link full
+	uint32_t blobs;
+	uint32_t blob_errors;		// Dropped or not the blob sent
+	uint64_t stream_bytes;		// Fragments, on the link
+};
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header		hdr;
+	int8_t			result;
+	uint8_t			sensor_id;
+} gw_msg_schema_result;
+
+static struct gw_thing *gw_things;
+static uint32_t gw_nthings;
+static struct gw_stats gw_stats;
+
+static void gw_send(struct gw_link *link, const void *frame, size_t len)
+{
+	if (send(link->fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		gw_stats.resp_dropped++;
+}
+
+/*
+ * Once online, the things are configured as a gateway would do: report
+ * every change of their items (LOADGEN_ITEMS of them, ids from 1)
+ */
+static void gw_thing_online(struct gw_link *link)
+{
+	knot_msg_config config;
+	uint64_t now;
+	uint8_t id;
+
+	if (link->thing < 0 || gw_things[link->thing].online_us)
+		return;
+
+	now = now_us();
+	gw_things[link->thing].online_us = now - start_us;
+	gw_stats.online++;
+	gw_stats.last_online_us = now;
+
+	memset(&config, 0, sizeof(config));
+	config.hdr.type = KNOT_MSG_SET_CONFIG;
+	config.hdr.payload_len = sizeof(config) - sizeof(config.hdr);
+	config.values.event_flags = KNOT_EVT_FLAG_CHANGE;
+
+	for (id = 1; id <= LOADGEN_ITEMS; id++) {
+		config.sensor_id = id;
+		gw_send(link, &config, sizeof(config));
+	}
+}
+
+static void gw_register(struct gw_link *link, const knot_msg_register *req)
+{
+	char name[KNOT_PROTOCOL_DEVICE_NAME_LEN + 1];
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	knot_msg_credential crdntl;
+	unsigned int thing;
+
+	memset(name, 0, sizeof(name));
+	memcpy(name, req->devName, (req->hdr.payload_len < sizeof(name) ?
+					req->hdr.payload_len : sizeof(name) - 1));
+	if (sscanf(name, LOADGEN_NAME, &thing) != 1 || thing >= gw_nthings)
+		return;
+
+	link->thing = thing;
+
+	memset(&crdntl, 0, sizeof(crdntl));
+	crdntl.hdr.type = KNOT_MSG_REGISTER_RESP;
+	crdntl.hdr.payload_len = sizeof(crdntl) - sizeof(crdntl.hdr);
+	crdntl.result = KNOT_SUCCESS;
+	snprintf(uuid, sizeof(uuid), "%08x-0000-0000-0000-000000000000",
+								thing);
+	memcpy(crdntl.uuid, uuid, sizeof(crdntl.uuid));
+	memset(crdntl.token, 'a', sizeof(crdntl.token));
+	gw_send(link, &crdntl, sizeof(crdntl));
+
+	gw_stats.registrations++;
+	gw_stats.last_registration_us = now_us();
+}
+
+static void gw_auth(struct gw_link *link, const knot_msg_auth_schema *req)
+{
+	char uuid[KNOT_PROTOCOL_UUID_LEN + 1];
+	knot_msg_auth_result resp;
+	unsigned int thing;
+
+	memset(uuid, 0, sizeof(uuid));
+	memcpy(uuid, req->uuid, sizeof(req->uuid));
+	if (sscanf(uuid, "%08x-", &thing) != 1 || thing >= gw_nthings)
+		return;
+
+	link->thing = thing;
+
+	resp.hdr.type = KNOT_MSG_AUTH_RESP;
+	resp.hdr.payload_len = sizeof(resp) - sizeof(resp.hdr);
+	resp.result = KNOT_SUCCESS;
+	resp.schema = (gw_things[thing].schema_known ? KNOT_SCHEMA_KNOWN :
+							KNOT_SCHEMA_UNKNOWN);
+	gw_send(link, &resp, sizeof(resp));
+
+	if (gw_things[thing].schema_known)
+		gw_thing_online(link);
+}
+
+static void gw_schema(struct gw_link *link, const knot_msg_schema *req)
+{
+	gw_msg_schema_result resp;
+
+	resp.hdr.type = (req->hdr.type == KNOT_MSG_SCHEMA_END ?
+			KNOT_MSG_SCHEMA_END_RESP : KNOT_MSG_SCHEMA_RESP);
+	resp.hdr.payload_len = sizeof(resp) - sizeof(resp.hdr);
+	resp.result = KNOT_SUCCESS;
+	resp.sensor_id = req->sensor_id;
+	gw_send(link, &resp, sizeof(resp));
+
+	gw_stats.schemas++;
+
+	if (req->hdr.type != KNOT_MSG_SCHEMA_END || link->thing < 0)
+		return;
+
+	gw_things[link->thing].schema_known = 1;
+	gw_thing_online(link);
+}
+
+static void gw_stream(struct gw_link *link, const uint8_t *frame,
+								ssize_t len)
+{
+	struct knot_stream_rx *rx = &link->stream;
+	uint32_t i;
+
+	gw_stats.stream_bytes += len;
+
+	if (knot_stream_rx_frame(rx, (const knot_msg_data_stream *) frame,
+								len) != 1)
+		return;
+
+	gw_stats.blobs++;
+	if (rx->len != blob_size) {
+		gw_stats.blob_errors++;
+		return;
+	}
+
+	for (i = 0; i < rx->len; i++) {
+		if (rx->blob[i] != blob_byte(i)) {
+			gw_stats.blob_errors++;
+			return;
+		}
+	}
+}
+
+static void gw_frame(struct gw_link *link, const uint8_t *frame, ssize_t len)
+{
+	const knot_msg_header *hdr = (const knot_msg_header *) frame;
+
+	switch (hdr->type) {
+	case KNOT_MSG_REGISTER_REQ:
+		gw_register(link, (const knot_msg_register *) frame);
+		break;
+	case KNOT_MSG_AUTH_REQ:
+		gw_auth(link, (const knot_msg_auth_schema *) frame);
+		break;
+	case KNOT_MSG_SCHEMA:
+	case KNOT_MSG_SCHEMA_END:
+		gw_schema(link, (const knot_msg_schema *) frame);
+		break;
+	case KNOT_MSG_DATA:
+	case KNOT_MSG_DATA_BATCH:
+	case KNOT_MSG_DATA_COMPACT:
+		/* Sustained rate: only once the ramp up is over */
+		if (gw_stats.online < gw_nthings)
+			break;
+
+		gw_stats.data_frames++;
+		gw_stats.data_bytes += len;
+		break;
+	case KNOT_MSG_DATA_STREAM:
+		gw_stream(link, frame, len);
+		break;
+	default:
+		break;
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void gw_report(uint64_t end_us)
+{
+	uint64_t *online, ramp_us, steady_us;
+	uint32_t i, n = 0;
+
+	printf("things               %u\n", gw_nthings);
+
+	ramp_us = gw_stats.last_registration_us - start_us;
+	printf("registrations        %u", gw_stats.registrations);
+	if (gw_stats.registrations && ramp_us)
+		printf(" (%.1f/s)", gw_stats.registrations * 1e6 / ramp_us);
+	printf("\n");
+
+	printf("schemas acked        %u\n", gw_stats.schemas);
+	printf("online               %u\n", gw_stats.online);
+
+	online = calloc(gw_nthings, sizeof(*online));
+	if (online == NULL)
+		return;
+
+	for (i = 0; i < gw_nthings; i++) {
+		if (gw_things[i].online_us)
+			online[n++] = gw_things[i].online_us;
+	}
+
+	if (n > 0) {
+		qsort(online, n, sizeof(*online), cmp_u64);
+		printf("time to online ms    p50 %.1f p90 %.1f p99 %.1f "
+			"max %.1f\n", online[n / 2] / 1e3,
+			online[n * 90 / 100] / 1e3, online[n * 99 / 100] / 1e3,
+			online[n - 1] / 1e3);
+	}
+	free(online);
+
+	if (gw_stats.online < gw_nthings) {
+		printf("data frames/s        - (not every thing online)\n");
+	} else {
+		steady_us = end_us - gw_stats.last_online_us;
+		printf("data frames/s        %.1f (%.1f bytes/s over %.1f s)\n",
+			steady_us ? gw_stats.data_frames * 1e6 / steady_us : 0,
+			steady_us ? gw_stats.data_bytes * 1e6 / steady_us : 0,
+			steady_us / 1e6);
+	}
+
+	if (blob_size) {
+		steady_us = end_us - start_us;
+		printf("stream blobs         %u (%.1f/s, %.1f%% of the bytes "
+			"on the link, %u errors)\n", gw_stats.blobs,
+			gw_stats.blobs * 1e6 / steady_us,
+			gw_stats.blobs ? gw_stats.stream_bytes * 100.0 /
+				((uint64_t) gw_stats.blobs * blob_size) : 0,
+			gw_stats.blob_errors);
+	}
+
+	printf("gw responses dropped %u\n", gw_stats.resp_dropped);
+}
+
+static int gateway(const char *path, int listen_fd, uint64_t end_us)
+{
+	uint8_t frame[LOADGEN_FRAME_MAX];
+	struct gw_link *links;
+	struct pollfd *pfds;
+	uint32_t nlinks = 0, i;
+	ssize_t len;
+	int fd;
+
+	gw_things = calloc(gw_nthings, sizeof(*gw_things));
+	links = calloc(gw_nthings, sizeof(*links));
+	/* Listening socket first, then one entry per link */
+	pfds = calloc(gw_nthings + 1, sizeof(*pfds));
+	if (gw_things == NULL || links == NULL || pfds == NULL)
+		return EXIT_FAILURE;
+
+	pfds[0].fd = listen_fd;
+	pfds[0].events = POLLIN;
+
+	while (now_us() < end_us) {
+		if (poll(pfds, nlinks + 1, 10) < 0 && errno != EINTR)
+			break;
+
+		if ((pfds[0].revents & POLLIN) && nlinks < gw_nthings) {
+			fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK |
+								SOCK_CLOEXEC);
+			if (fd >= 0) {
+				links[nlinks].fd = fd;
+				links[nlinks].thing = -1;
+				knot_stream_rx_init(&links[nlinks].stream);
+				pfds[nlinks + 1].fd = fd;
+				pfds[nlinks + 1].events = POLLIN;
+				pfds[nlinks + 1].revents = 0;
+				nlinks++;
+			}
+		}
+
+		for (i = 0; i < nlinks; i++) {
+			if (!pfds[i + 1].revents)
+				continue;
+
+			while ((len = recv(links[i].fd, frame, sizeof(frame),
+							MSG_DONTWAIT)) > 0) {
+				if (len >= (ssize_t) sizeof(knot_msg_header))
+					gw_frame(&links[i], frame, len);
+			}
+
+			if (len < 0 && errno == EAGAIN)
+				continue;
+
+			/* Thing closed the link: drop it */
+			close(links[i].fd);
+			knot_stream_rx_free(&links[i].stream);
+			nlinks--;
+			links[i] = links[nlinks];
+			pfds[i + 1] = pfds[nlinks + 1];
+			i--;
+		}
+	}
+
+	gw_report(now_us());
+
+	for (i = 0; i < nlinks; i++) {
+		close(links[i].fd);
+		knot_stream_rx_free(&links[i].stream);
+	}
+	close(listen_fd);
+	unlink(path);
+
+	free(pfds);
+	free(links);
+	free(gw_things);
+
+	return EXIT_SUCCESS;
+}
+
+static int gateway_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+/*
+ * Synthetic sensors: values move on every read so change events keep
+ * firing. They are shared by every thing, which is fine for load.
+ */
+
+static int32_t counter;
+
+static int int_read(int32_t *val, int32_t *multiplier)
+{
+	*val = counter++;
+	*multiplier = 1;
+	return 0;
+}
+
+static int float_read(int32_t *val_int, uint32_t *val_dec, int32_t *multiplier)
+{
+	*val_int = counter++;
+	*val_dec = 5;
+	*multiplier = 1;
+	return 0;
+}
+
+static int bool_read(uint8_t *val)
+{
+	*val = (counter++) & 0x01;
+	return 0;
+}
+
+static int raw_read(uint8_t *val, uint8_t *len)
+{
+	memset(val, (uint8_t) counter++, KNOT_DATA_RAW_SIZE);
+	*len = KNOT_DATA_RAW_SIZE;
+	return 0;
+}
+
+static int blob_read(uint32_t offset, uint8_t *buf, uint8_t len)
+{
+	uint8_t i;
+
+	if (offset >= blob_size)
+		return 0;
+
+	if (len > blob_size - offset)
+		len = blob_size - offset;
+
+	for (i = 0; i < len; i++)
+		buf[i] = blob_byte(offset + i);
+
+	return len;
+}
+
+static int thing_setup(struct knot_thing_ctx *ctx, uint32_t index,
+							uint8_t *raw_buffer)
+{
+	knot_data_functions func;
+	knot_stream_functions stream;
+	char name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
+	int err = 0;
+
+	snprintf(name, sizeof(name), LOADGEN_NAME, index);
+	if (knot_thing_ctx_init(ctx, name, KNOT_THING_NO_STORAGE) < 0)
+		return -1;
+
+	memset(&func, 0, sizeof(func));
+	func.int_f.read = int_read;
+	err |= knot_thing_ctx_register_data_item(ctx, 1, "int",
+				KNOT_TYPE_ID_NONE, KNOT_VALUE_TYPE_INT,
+				KNOT_UNIT_NOT_APPLICABLE, &func);
+	func.float_f.read = float_read;
+	err |= knot_thing_ctx_register_data_item(ctx, 2, "float",
+				KNOT_TYPE_ID_NONE, KNOT_VALUE_TYPE_FLOAT,
+				KNOT_UNIT_NOT_APPLICABLE, &func);
+	func.bool_f.read = bool_read;
+	err |= knot_thing_ctx_register_data_item(ctx, 3, "bool",
+				KNOT_TYPE_ID_NONE, KNOT_VALUE_TYPE_BOOL,
+				KNOT_UNIT_NOT_APPLICABLE, &func);
+	func.raw_f.read = raw_read;
+	err |= knot_thing_ctx_register_raw_data_item(ctx, 4, "raw",
+				raw_buffer, KNOT_DATA_RAW_SIZE,
+				KNOT_TYPE_ID_NONE, KNOT_VALUE_TYPE_RAW,
+				KNOT_UNIT_NOT_APPLICABLE, &func);
+	if (blob_size) {
+		stream.read = blob_read;
+		stream.write = NULL;
+		err |= knot_thing_ctx_register_stream_data_item(ctx,
+				LOADGEN_STREAM_ID, "blob", KNOT_TYPE_ID_NONE,
+				KNOT_UNIT_NOT_APPLICABLE, &stream,
+				KNOT_STREAM_FLAG_LZ);
+	}
+	if (err)
+		return -1;
+
+	return 0;
+}
+
+static int raise_fd_limit(rlim_t needed)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return -errno;
+
+	if (rl.rlim_cur >= needed)
+		return 0;
+
+	if (rl.rlim_max < needed)
+		return -EMFILE;
+
+	rl.rlim_cur = needed;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n things] [-d seconds] [-s path] "
+					"[-b bytes] [-t trace.json]\n", prog);
+}
+
+static void trace_dump(const char *trace_path)
+{
+	FILE *fp;
+	int count;
+
+	fp = fopen(trace_path, "w");
+	if (fp == NULL) {
+		perror(trace_path);
+		return;
+	}
+
+	count = knot_trace_write(fp);
+	fclose(fp);
+
+	if (count == -ENOTSUP)
+		fprintf(stderr, "%s: tracing not built in, see knot_trace.h\n",
+								trace_path);
+	else if (count < 0)
+		fprintf(stderr, "%s: %s\n", trace_path, strerror(-count));
+	else
+		printf("trace events         %d (%s)\n", count, trace_path);
+}
+
+/* Thing side counters, summed over every thing */
+static void thing_stats(struct knot_thing_ctx *things, uint32_t nthings)
+{
+	struct knot_thing_stats stats;
+	uint64_t readings = 0, coalesced = 0, errors = 0, changes = 0;
+	uint32_t i;
+
+	for (i = 0; i < nthings; i++) {
+		knot_thing_ctx_get_stats(&things[i], &stats);
+		readings += stats.proto.readings;
+		coalesced += stats.proto.coalesced;
+		errors += stats.proto.errors;
+		changes += stats.proto.state_changes;
+	}
+
+	printf("thing readings       %llu (%llu coalesced)\n",
+		(unsigned long long) readings, (unsigned long long) coalesced);
+	printf("thing state changes  %llu (%llu errors)\n",
+		(unsigned long long) changes, (unsigned long long) errors);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = LOADGEN_DEFAULT_PATH;
+	const char *trace_path = NULL;
+	uint32_t nthings = LOADGEN_DEFAULT_THINGS;
+	uint32_t seconds = LOADGEN_DEFAULT_SECONDS;
+	const struct hal_sock_stats *stats;
+	struct knot_thing_ctx *things;
+	uint8_t (*raw_buffers)[KNOT_DATA_RAW_SIZE];
+	uint64_t end_us;
+	uint32_t i;
+	int opt, listen_fd, status;
+	pid_t gw;
+
+	while ((opt = getopt(argc, argv, "n:d:s:b:t:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nthings = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'b':
+			blob_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nthings == 0 || seconds == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Two sockets per thing: the HAL handle and the link */
+	if (raise_fd_limit(2 * (rlim_t) nthings + 16) < 0) {
+		fprintf(stderr, "not enough file descriptors for %u things\n",
+								nthings);
+		return EXIT_FAILURE;
+	}
+
+	listen_fd = gateway_listen(path);
+	if (listen_fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(-listen_fd));
+		return EXIT_FAILURE;
+	}
+
+	start_us = now_us();
+	end_us = start_us + (uint64_t) seconds * 1000000;
+
+	gw_nthings = nthings;
+	gw = fork();
+	if (gw < 0) {
+		perror("fork");
+		return EXIT_FAILURE;
+	}
+
+	if (gw == 0)
+		return gateway(path, listen_fd, end_us);
+
+	close(listen_fd);
+
+	things = calloc(nthings, sizeof(*things));
+	raw_buffers = calloc(nthings, sizeof(*raw_buffers));
+	if (things == NULL || raw_buffers == NULL) {
+		fprintf(stderr, "out of memory for %u things\n", nthings);
+		kill(gw, SIGTERM);
+		return EXIT_FAILURE;
+	}
+
+	hal_sock_set_path(path);
+
+	for (i = 0; i < nthings; i++) {
+		if (thing_setup(&things[i], i, raw_buffers[i]) < 0) {
+			fprintf(stderr, "thing %u setup failed\n", i);
+			kill(gw, SIGTERM);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%u things, %zu bytes each, %u s\n", nthings,
+					sizeof(struct knot_thing_ctx), seconds);
+	fflush(stdout);
+
+	while (now_us() < end_us) {
+		for (i = 0; i < nthings; i++) {
+			/* Next blob as soon as the previous one is out */
+			if (blob_size)
+				knot_thing_ctx_send_stream(&things[i],
+							LOADGEN_STREAM_ID);
+			knot_thing_ctx_run(&things[i]);
+		}
+
+		/* Don't starve the gateway when there are few things */
+		if (nthings < 1000)
+			usleep(1000);
+	}
+
+	waitpid(gw, &status, 0);
+
+	stats = hal_sock_get_stats();
+	printf("thing connects       %u (%u retries)\n", stats->connects,
+						stats->connect_retries);
+	printf("thing frames sent    %u (%llu bytes, %u EAGAIN, %u errors)\n",
+			stats->comm_writes,
+			(unsigned long long) stats->comm_tx_bytes,
+			stats->comm_write_eagain, stats->comm_write_errors);
+
+	thing_stats(things, nthings);
+
+	if (trace_path)
+		trace_dump(trace_path);
+
+	for (i = 0; i < nthings; i++)
+		knot_thing_ctx_exit(&things[i]);
+
+	free(raw_buffers);
+	free(things);
+
+	return (WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "knot_stream.h"
+
+/* Compressed fragments expand to at most 255 bytes */
+#define STREAM_FRAGMENT_MAX		255
+
+int knot_lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out,
+							size_t out_len)
+{
+	size_t ip = 0, op = 0, len, dist;
+	uint8_t ctrl;
+
+	while (ip < in_len) {
+		ctrl = in[ip++];
+
+		if (ctrl < 32) {
+			len = ctrl + 1;
+			if (ip + len > in_len)
+				return -EINVAL;
+			if (op + len > out_len)
+				return -ENOSPC;
+
+			memcpy(out + op, in + ip, len);
+			ip += len;
+			op += len;
+			continue;
+		}
+
+		len = ctrl >> 5;
+		if (len == 7) {
+			if (ip >= in_len)
+				return -EINVAL;
+			len += in[ip++];
+		}
+		len += 2;
+
+		if (ip >= in_len)
+			return -EINVAL;
+		dist = ((size_t) (ctrl & 0x1f) << 8) + in[ip++] + 1;
+		if (dist > op)
+			return -EINVAL;
+		if (op + len > out_len)
+			return -ENOSPC;
+
+		/* Byte by byte: the reference may overlap the output */
+		for (; len > 0; len--, op++)
+			out[op] = out[op - dist];
+	}
+
+	return op;
+}
+
+void knot_stream_rx_init(struct knot_stream_rx *rx)
+{
+	memset(rx, 0, sizeof(*rx));
+}
+
+void knot_stream_rx_free(struct knot_stream_rx *rx)
+{
+	free(rx->blob);
+	knot_stream_rx_init(rx);
+}
+
+static int stream_drop(struct knot_stream_rx *rx, int err)
+{
+	if (rx->active)
+		rx->dropped++;
+	rx->active = 0;
+
+	return err;
+}
+
+int knot_stream_rx_frame(struct knot_stream_rx *rx,
+			const knot_msg_data_stream *msg, size_t len)
+{
+	size_t data_len;
+	uint8_t *blob;
+	int n;
+
+	if (len < KNOT_STREAM_HDR_LEN ||
+			len != sizeof(msg->hdr) + msg->hdr.payload_len)
+		return stream_drop(rx, -EINVAL);
+
+	data_len = len - KNOT_STREAM_HDR_LEN;
+
+	if (msg->seq == 0) {
+		/* A new blob: one not over yet lost its last fragments */
+		stream_drop(rx, 0);
+		rx->active = 1;
+		rx->stream = msg->stream;
+		rx->seq = 0;
+		rx->len = 0;
+	} else if (!rx->active || msg->stream != rx->stream ||
+						msg->seq != rx->seq)
+		return stream_drop(rx, -EPROTO);
+
+	if (rx->size < rx->len + STREAM_FRAGMENT_MAX) {
+		blob = realloc(rx->blob, 2 * rx->size + STREAM_FRAGMENT_MAX);
+		if (blob == NULL)
+			return stream_drop(rx, -ENOMEM);
+
+		rx->blob = blob;
+		rx->size = 2 * rx->size + STREAM_FRAGMENT_MAX;
+	}
+
+	if (msg->flags & KNOT_STREAM_FLAG_LZ) {
+		n = knot_lz_decompress(msg->data, data_len,
+				rx->blob + rx->len, STREAM_FRAGMENT_MAX);
+		if (n < 0)
+			return stream_drop(rx, n);
+	} else {
+		memcpy(rx->blob + rx->len, msg->data, data_len);
+		n = data_len;
+	}
+
+	rx->len += n;
+	rx->seq++;
+
+	if (!(msg->flags & KNOT_STREAM_FLAG_LAST))
+		return 0;
+
+	rx->active = 0;
+
+	return 1;
+}
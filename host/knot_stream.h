@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Receiver side of stream data items, as a gateway would do it:
+ * reassembles the KNOT_MSG_DATA_STREAM fragments of a data item into the
+ * blob, expanding the compressed ones.
+ */
+
+#ifndef __KNOT_STREAM_H__
+#define __KNOT_STREAM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "knot_thing_protocol.h"
+
+struct knot_stream_rx {
+	uint8_t		active;		// Fragments received, blob not over
+	uint8_t		stream;
+	uint16_t	seq;		// Next fragment expected
+	uint8_t		*blob;
+	size_t		len;
+	size_t		size;
+	uint32_t	dropped;	// Blobs missing a fragment
+};
+
+void knot_stream_rx_init(struct knot_stream_rx *rx);
+void knot_stream_rx_free(struct knot_stream_rx *rx);
+
+/*
+ * Adds a fragment of len bytes (frame header included). Returns 1 once
+ * the blob is complete, in blob and len until the next fragment, 0 while
+ * it is not, or < 0 if the fragment is invalid or out of sequence: the
+ * blob is dropped, and reassembly starts over at the next seq 0.
+ */
+int knot_stream_rx_frame(struct knot_stream_rx *rx,
+			const knot_msg_data_stream *msg, size_t len);
+
+/*
+ * Expands LZF data (see KNOT_MSG_DATA_STREAM). Returns the length
+ * expanded, or < 0 if it is invalid or longer than out_len.
+ */
+int knot_lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out,
+							size_t out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __KNOT_STREAM_H__ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "knot_thing_trace.h"
+#include "knot_trace.h"
+
+static const char * const trace_names[KNOT_TRACE_ID_MAX] = {
+	[KNOT_TRACE_ID_RUN]		= "run",
+	[KNOT_TRACE_ID_STATE]		= "state",
+	[KNOT_TRACE_ID_ACCEPT]		= "comm_accept",
+	[KNOT_TRACE_ID_COMM_READ]	= "comm_read",
+	[KNOT_TRACE_ID_COMM_WRITE]	= "comm_write",
+	[KNOT_TRACE_ID_EVENTS]		= "check_events",
+	[KNOT_TRACE_ID_READ]		= "item_read",
+	[KNOT_TRACE_ID_WRITE]		= "item_write",
+	[KNOT_TRACE_ID_ASYNC]		= "item_convert",
+	[KNOT_TRACE_ID_LOG]		= "log",
+	[KNOT_TRACE_ID_STREAM]		= "stream_fragment",
+};
+
+/* What arg holds, by trace point and phase (begin/instant, end) */
+static const char * const trace_args[KNOT_TRACE_ID_MAX][2] = {
+	[KNOT_TRACE_ID_RUN]		= { "state", "state" },
+	[KNOT_TRACE_ID_STATE]		= { "state", "state" },
+	[KNOT_TRACE_ID_ACCEPT]		= { NULL, NULL },
+	[KNOT_TRACE_ID_COMM_READ]	= { NULL, "type" },
+	[KNOT_TRACE_ID_COMM_WRITE]	= { "type", "bytes" },
+	[KNOT_TRACE_ID_EVENTS]		= { "scheduled", "sensor_id" },
+	[KNOT_TRACE_ID_READ]		= { "sensor_id", "sensor_id" },
+	[KNOT_TRACE_ID_WRITE]		= { "sensor_id", "sensor_id" },
+	[KNOT_TRACE_ID_ASYNC]		= { "sensor_id", "sensor_id" },
+	[KNOT_TRACE_ID_LOG]		= { "sensor_id", "pending" },
+	[KNOT_TRACE_ID_STREAM]		= { "sensor_id", "bytes" },
+};
+
+int knot_trace_write(FILE *fp)
+{
+	struct knot_thing_trace_event *events;
+	const struct knot_thing_trace_event *ev;
+	const char *arg, *sep = "";
+	uint64_t time = 0;
+	uint32_t last = 0, depth = 0;
+	uint16_t i, count;
+	int written = 0;
+
+	if (KNOT_THING_TRACE_LEN == 0)
+		return -ENOTSUP;
+
+	events = calloc(KNOT_THING_TRACE_LEN, sizeof(*events));
+	if (events == NULL)
+		return -ENOMEM;
+
+	count = knot_thing_trace_copy(events, KNOT_THING_TRACE_LEN);
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (i = 0; i < count; i++) {
+		ev = &events[i];
+
+		/* 32 bit us clock: wraps every ~71 minutes */
+		if (i > 0)
+			time += (uint32_t) (ev->time - last);
+		last = ev->time;
+
+		if (ev->id >= KNOT_TRACE_ID_MAX)
+			continue;
+
+		/* Spans whose begin was overwritten by the ring wrapping */
+		if (ev->phase == KNOT_TRACE_PHASE_END) {
+			if (depth == 0)
+				continue;
+			depth--;
+		} else if (ev->phase == KNOT_TRACE_PHASE_BEGIN)
+			depth++;
+
+		fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,"
+				"\"pid\":1,\"tid\":1", sep, trace_names[ev->id],
+				ev->phase, (unsigned long long) time);
+
+		if (ev->phase == KNOT_TRACE_PHASE_INSTANT)
+			fprintf(fp, ",\"s\":\"t\"");
+
+		arg = trace_args[ev->id][ev->phase == KNOT_TRACE_PHASE_END];
+		if (arg)
+			fprintf(fp, ",\"args\":{\"%s\":%u}", arg, ev->arg);
+
+		fprintf(fp, "}");
+		sep = ",";
+		written++;
+	}
+
+	fprintf(fp, "\n]}\n");
+
+	free(events);
+
+	return written;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Export of the thing trace ring (see knot_thing_trace.h) in the Chrome
+ * trace event format, to be opened in chrome://tracing or Perfetto. The
+ * library must be built with tracing on:
+ *	rm -rf build/host && make loadgen HOST_TRACE_LEN=32768
+ */
+
+#ifndef __KNOT_TRACE_H__
+#define __KNOT_TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+/*
+ * Writes the events in the ring, oldest first, as a JSON trace. Returns
+ * the number of events written or -ENOTSUP if tracing is compiled out.
+ */
+int knot_trace_write(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __KNOT_TRACE_H__ */
@@ -76,8 +76,52 @@ int KNoTThing::registerRawData(const char *name, uint8_t *raw_buffer,
 		raw_buffer_len, type_id, KNOT_VALUE_TYPE_RAW, unit, &func);
 }
 
-void KNoTThing::run()
+int KNoTThing::registerStreamData(const char *name, uint8_t sensor_id,
+		uint16_t type_id, uint8_t unit, streamReadFunction read,
+		rawDataFunction write, uint8_t flags)
 {
-	knot_thing_run();
+	knot_stream_functions func;
+	func.read = read;
+	func.write = write;
+
+	return knot_thing_register_stream_data_item(sensor_id, name, type_id,
+							unit, &func, flags);
+}
+
+int KNoTThing::sendStream(uint8_t sensor_id)
+{
+	return knot_thing_send_stream(sensor_id);
+}
+
+int KNoTThing::registerAsyncRead(uint8_t sensor_id, asyncStartFunction start,
+						asyncReadyFunction ready)
+{
+	knot_async_functions async;
+	async.start = start;
+	async.ready = ready;
+
+	return knot_thing_register_async_read(sensor_id, &async);
+}
+
+int KNoTThing::aggregateData(uint8_t sensor_id, uint16_t period_ms,
+							uint32_t window_ms)
+{
+	return knot_thing_config_data_item_aggregate(sensor_id, period_ms,
+								window_ms);
+}
+
+void KNoTThing::setSleep(sleepFunction sleep)
+{
+	knot_thing_set_sleep(sleep);
+}
+
+void KNoTThing::stats(struct knot_thing_stats *stats)
+{
+	knot_thing_get_stats(stats);
+}
+
+int32_t KNoTThing::run()
+{
+	return knot_thing_run();
 }
 
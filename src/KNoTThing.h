@@ -38,12 +38,54 @@ public:
 			uint16_t type_id, uint8_t unit,
 			boolDataFunction read, boolDataFunction write);
 
+	/*
+	 * raw_buffer may be NULL. If given, the library keeps the last
+	 * value sent in it for KNOT_ENCODING_RAW_DELTA: it must stay
+	 * allocated and the sketch must not write to it afterwards.
+	 */
 	int registerRawData(const char *name, uint8_t *raw_buffer,
 			uint8_t raw_buffer_len, uint8_t sensor_id,
 			uint16_t type_id, uint8_t unit, rawDataFunction read,
 			rawDataFunction write);
 
-	void run();
+	/*
+	 * Registers an item whose value is a blob larger than a frame,
+	 * pulled chunk by chunk from read and sent in fragments, compressed
+	 * if flags is KNOT_STREAM_FLAG_LZ: see knot_stream_functions
+	 */
+	int registerStreamData(const char *name, uint8_t sensor_id,
+			uint16_t type_id, uint8_t unit, streamReadFunction read,
+			rawDataFunction write, uint8_t flags);
+
+	/* Starts sending the blob of a stream item */
+	int sendStream(uint8_t sensor_id);
+
+	/*
+	 * Makes the reads of a registered item split-phase, so a slow
+	 * sensor doesn't stall the loop: see knot_async_functions
+	 */
+	int registerAsyncRead(uint8_t sensor_id, asyncStartFunction start,
+						asyncReadyFunction ready);
+
+	/*
+	 * Samples an item every period_ms and sends min, max, mean and
+	 * count of the samples every window_ms, instead of each reading
+	 */
+	int aggregateData(uint8_t sensor_id, uint16_t period_ms,
+							uint32_t window_ms);
+
+	/*
+	 * Sleeps until the next work through the platform sleep function
+	 * (which may return sooner, e.g. on radio RX) instead of returning
+	 * to loop() at once
+	 */
+	void setSleep(sleepFunction sleep);
+
+	/* Reads the runtime counters of the thing */
+	void stats(struct knot_thing_stats *stats);
+
+	/* Returns the time (ms) until the thing has work to do again */
+	int32_t run();
 private:
 
 };
@@ -7,5 +7,199 @@
  *
  */
 
-/* Use defined: Thing amount of data source/sinks */
+/*
+ * Use defined: Thing amount of data source/sinks. Any sensor_id (0-255)
+ * may be used, only the number of registered items is bounded.
+ */
 #define KNOT_THING_DATA_MAX		5
+
+/*
+ * Use defined: Items that can have limits or event filters: int and float
+ * items configured with threshold events, and items with a
+ * knot_config_filter. Bool limits take no entry. Up to 254.
+ */
+#ifndef KNOT_THING_LIMITS_MAX
+#define KNOT_THING_LIMITS_MAX		KNOT_THING_DATA_MAX
+#endif
+
+/*
+ * Use defined: Items that can aggregate their samples at the same time,
+ * see knot_thing_config_data_item_aggregate(). Up to 254.
+ */
+#ifndef KNOT_THING_AGGREGATE_MAX
+#define KNOT_THING_AGGREGATE_MAX	1
+#endif
+
+/*
+ * Use defined: Keeps the last value sent of each item, so that it can
+ * answer KNOT_MSG_SET_ENCODING with KNOT_ENCODING_COMPACT and
+ * KNOT_ENCODING_RAW_DELTA. 0 only sends full readings, saving 16 bytes
+ * of RAM per item on AVR.
+ */
+#ifndef KNOT_THING_COMPACT_ENCODING
+#define KNOT_THING_COMPACT_ENCODING	0
+#endif
+
+/*
+ * Use defined: Sampling period (ms) of data items with change or threshold
+ * events. Items with time events are sampled every config.time_sec.
+ */
+#ifndef KNOT_THING_POLL_MS
+#define KNOT_THING_POLL_MS		100
+#endif
+
+/*
+ * Use defined: Interval (ms) at which a split-phase read in progress is
+ * polled for its result
+ */
+#ifndef KNOT_THING_ASYNC_POLL_MS
+#define KNOT_THING_ASYNC_POLL_MS	10
+#endif
+
+/*
+ * Use defined: Pack readings into KNOT_MSG_DATA_BATCH frames of up to this
+ * many bytes (header included) instead of one KNOT_MSG_DATA per reading.
+ * Requires gateway support; 0 disables batching. Must be at least 20
+ * bytes to fit a raw reading, and at most 255. 32 matches a single nRF24
+ * payload.
+ */
+#ifndef KNOT_THING_BATCH_MTU
+#define KNOT_THING_BATCH_MTU		0
+#endif
+
+/*
+ * Use defined: Outbound queue length, in readings. A reading waiting for
+ * the link is replaced by a newer one of the same sensor, and no new
+ * events are sampled while the queue is full.
+ */
+#ifndef KNOT_THING_TXQ_LEN
+#define KNOT_THING_TXQ_LEN		4
+#endif
+
+/*
+ * Use defined: Send the schema fingerprint in KNOT_MSG_AUTH_REQ, so a GW
+ * that knows the schema already skips the upload. Requires gateway
+ * support: the request is longer than a plain one. 0 disables it.
+ */
+#ifndef KNOT_THING_SCHEMA_FINGERPRINT
+#define KNOT_THING_SCHEMA_FINGERPRINT	0
+#endif
+
+/*
+ * Use defined: Delay (ms) before sending again while the link is busy
+ * (-EAGAIN). It doubles on every consecutive busy run, up to
+ * KNOT_THING_IDLE_MAX_MS.
+ */
+#ifndef KNOT_THING_TX_RETRY_MS
+#define KNOT_THING_TX_RETRY_MS		10
+#endif
+
+/*
+ * Use defined: Schema frames sent before waiting for their acks. 1 is
+ * stop-and-wait, one GW round trip per data item, as gateways that match
+ * acks to schemas in order expect. Larger windows need a GW that takes
+ * several schemas in flight.
+ */
+#ifndef KNOT_THING_SCHEMA_WINDOW
+#define KNOT_THING_SCHEMA_WINDOW	1
+#endif
+
+/* Use defined: Max time (ms) a reading may wait in a partial batch */
+#ifndef KNOT_THING_BATCH_AGE_MS
+#define KNOT_THING_BATCH_AGE_MS		200
+#endif
+
+/*
+ * Use defined: Longest time (ms) the run loop may sleep while a frame from
+ * the gateway may arrive. Frames are only read by knot_thing_run(), so a
+ * platform that can't wake up on radio RX answers the gateway at most
+ * this late.
+ */
+#ifndef KNOT_THING_IDLE_MAX_MS
+#define KNOT_THING_IDLE_MAX_MS		100
+#endif
+
+/*
+ * Use defined: Reconnect backoff (ms). The delay after a failure doubles
+ * on every consecutive failure, from KNOT_THING_RETRY_MIN_MS up to
+ * KNOT_THING_RETRY_MAX_MS, and half of it is random.
+ */
+#ifndef KNOT_THING_RETRY_MIN_MS
+#define KNOT_THING_RETRY_MIN_MS		250
+#endif
+
+#ifndef KNOT_THING_RETRY_MAX_MS
+#define KNOT_THING_RETRY_MAX_MS		30000
+#endif
+
+/*
+ * Use defined: Readings taken while the gateway is unreachable are kept in
+ * a log of this many bytes of HAL storage, from KNOT_THING_LOG_ADDR on,
+ * and uploaded once the thing is online again. Each reading takes 27
+ * bytes; when full the oldest ones are dropped. 0 disables the log. The
+ * area must not overlap anything else the sketch keeps in storage.
+ */
+#ifndef KNOT_THING_LOG_SIZE
+#define KNOT_THING_LOG_SIZE		0
+#endif
+
+#ifndef KNOT_THING_LOG_ADDR
+#define KNOT_THING_LOG_ADDR		0
+#endif
+
+/*
+ * Use defined: Min interval (ms) between two logged readings uploaded, so
+ * the backlog doesn't starve live readings
+ */
+#ifndef KNOT_THING_LOG_UPLOAD_MS
+#define KNOT_THING_LOG_UPLOAD_MS	50
+#endif
+
+/*
+ * Use defined: With KNOT_ENCODING_RAW_DELTA, a raw item sends its full
+ * value again after this many deltas, so a GW that lost one catches up
+ */
+#ifndef KNOT_THING_RAW_REFRESH
+#define KNOT_THING_RAW_REFRESH		16
+#endif
+
+/*
+ * Use defined: Data bytes per KNOT_MSG_DATA_STREAM fragment, up to
+ * KNOT_STREAM_DATA_MAX. Stream data items send blobs larger than a frame
+ * as a sequence of fragments. 0 disables streaming.
+ */
+#ifndef KNOT_THING_STREAM_FRAG_LEN
+#define KNOT_THING_STREAM_FRAG_LEN	0
+#endif
+
+/*
+ * Use defined: Blob bytes read for each compressed fragment (at most 255),
+ * buffered in the thing context. The more the better the compression,
+ * as long as they still fit in a fragment once compressed.
+ */
+#ifndef KNOT_THING_STREAM_CHUNK
+#define KNOT_THING_STREAM_CHUNK		(2 * KNOT_THING_STREAM_FRAG_LEN)
+#endif
+
+/*
+ * Use defined: Trace ring length, in events (8 bytes each). Trace points
+ * in the run loop record timestamped events from KNOT_THING_TRACE_CLOCK()
+ * (us), the newest KNOT_THING_TRACE_LEN (up to 65535) of them are kept. 0
+ * compiles the trace points out. See knot_thing_trace.h.
+ */
+#ifndef KNOT_THING_TRACE_LEN
+#define KNOT_THING_TRACE_LEN		0
+#endif
+
+#ifndef KNOT_THING_TRACE_CLOCK
+#define KNOT_THING_TRACE_CLOCK()	hal_time_us()
+#endif
+
+/*
+ * Use defined: Decimal digits of float items kept when comparing their
+ * values with the limits and filters (at most 6). Values are compared as
+ * 32 bits integers, so float items must stay within +/-2^31 / 10^digits.
+ */
+#ifndef KNOT_THING_FLOAT_DIGITS
+#define KNOT_THING_FLOAT_DIGITS		2
+#endif
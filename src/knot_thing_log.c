@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "knot_thing_config.h"
+#include "knot_thing_protocol.h"
+#include "knot_thing_log.h"
+#include "include/avr_errno.h"
+#include "include/storage.h"
+#include "include/time.h"
+
+#if KNOT_THING_LOG_SIZE > 0
+
+/* Record states. Erased storage (0xff) is neither */
+#define LOG_PENDING			0xa5
+#define LOG_SENT			0x00
+
+#define LOG_CRC_INIT			0xff
+#define LOG_CRC_POLY			0x07
+
+struct __attribute__ ((packed)) log_record {
+	uint8_t		state;
+	uint8_t		crc;		// Of everything after it
+	uint16_t	seq;
+	uint32_t	time;		// hal_time_ms() when logged
+	uint8_t		type;		// KNOT_MSG_DATA*
+	uint8_t		sensor_id;
+	uint8_t		len;
+	uint8_t		value[KNOT_DATA_RAW_SIZE];
+};
+
+#define LOG_HDR_LEN			offsetof(struct log_record, value)
+#define LOG_CRC_START			offsetof(struct log_record, seq)
+#define LOG_SLOTS			(KNOT_THING_LOG_SIZE / \
+						sizeof(struct log_record))
+
+#define slot_addr(_slot)		(KNOT_THING_LOG_ADDR + \
+					(_slot) * sizeof(struct log_record))
+
+static uint8_t crc8(const uint8_t *data, uint8_t len)
+{
+	uint8_t crc = LOG_CRC_INIT, bit;
+
+	while (len--) {
+		crc ^= *data++;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80 ? (crc << 1) ^ LOG_CRC_POLY :
+								crc << 1);
+	}
+
+	return crc;
+}
+
+static uint8_t record_crc(const struct log_record *rec)
+{
+	return crc8((const uint8_t *) rec + LOG_CRC_START,
+				LOG_HDR_LEN - LOG_CRC_START + rec->len);
+}
+
+/* Reads the record of a slot: 0 if it holds a valid one */
+static int record_read(uint16_t slot, struct log_record *rec)
+{
+	if (hal_storage_read(slot_addr(slot), (uint8_t *) rec,
+						sizeof(*rec)) < 0)
+		return -EIO;
+
+	if (rec->state != LOG_PENDING && rec->state != LOG_SENT)
+		return -ENOENT;
+
+	if (rec->len > sizeof(rec->value) || record_crc(rec) != rec->crc)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Wrap safe: true if sequence number 'a' comes after 'b' */
+static inline uint8_t seq_after(uint16_t a, uint16_t b)
+{
+	return ((int16_t) (a - b) > 0);
+}
+
+void knot_thing_log_init(struct knot_thing_log *log)
+{
+	struct log_record rec;
+	uint16_t slot, newest = 0, oldest = 0;
+	uint8_t found = 0, pending = 0;
+
+	memset(log, 0, sizeof(*log));
+
+	for (slot = 0; slot < LOG_SLOTS; slot++) {
+		if (record_read(slot, &rec) < 0)
+			continue;
+
+		if (!found || seq_after(rec.seq, newest)) {
+			newest = rec.seq;
+			log->head = (slot + 1) % LOG_SLOTS;
+		}
+		found = 1;
+
+		if (rec.state != LOG_PENDING)
+			continue;
+
+		if (!pending || seq_after(oldest, rec.seq)) {
+			oldest = rec.seq;
+			log->tail = slot;
+		}
+		pending = 1;
+	}
+
+	if (!found)
+		return;
+
+	log->seq = newest + 1;
+
+	if (!pending) {
+		log->tail = log->head;
+		return;
+	}
+
+	/* Records written in turn: the pending ones run up to the head */
+	log->count = (log->head + LOG_SLOTS - log->tail) % LOG_SLOTS;
+	if (log->count == 0)
+		log->count = LOG_SLOTS;
+	log->stale = log->count;
+}
+
+int knot_thing_log_append(struct knot_thing_log *log,
+					const knot_msg_data *data)
+{
+	struct log_record rec;
+	ssize_t nbytes;
+
+	rec.state = LOG_PENDING;
+	rec.seq = log->seq;
+	rec.time = hal_time_ms();
+	rec.type = data->hdr.type;
+	rec.sensor_id = data->sensor_id;
+	rec.len = data->hdr.payload_len - sizeof(data->sensor_id);
+	if (rec.len > sizeof(rec.value))
+		return -EINVAL;
+
+	memcpy(rec.value, &data->payload, rec.len);
+	rec.crc = record_crc(&rec);
+
+	/* Only the bytes used: less wear for short values */
+	nbytes = hal_storage_write(slot_addr(log->head), (uint8_t *) &rec,
+							LOG_HDR_LEN + rec.len);
+	if (nbytes < 0)
+		return nbytes;
+
+	log->seq++;
+	log->head = (log->head + 1) % LOG_SLOTS;
+
+	/* Full: the oldest record was just overwritten */
+	if (log->count == LOG_SLOTS) {
+		log->tail = log->head;
+		if (log->stale)
+			log->stale--;
+	} else
+		log->count++;
+
+	return 0;
+}
+
+int knot_thing_log_peek(struct knot_thing_log *log, knot_msg_data *data,
+							uint32_t *age)
+{
+	struct log_record rec;
+
+	/* Skips records torn or uploaded already */
+	while (log->count > 0) {
+		if (record_read(log->tail, &rec) == 0 &&
+						rec.state == LOG_PENDING)
+			break;
+
+		knot_thing_log_pop(log);
+	}
+
+	if (log->count == 0)
+		return -ENOENT;
+
+	data->hdr.type = rec.type;
+	data->hdr.payload_len = sizeof(data->sensor_id) + rec.len;
+	data->sensor_id = rec.sensor_id;
+	memcpy(&data->payload, rec.value, rec.len);
+
+	/* hal_time_ms() starts over on restart */
+	*age = (log->stale ? KNOT_LOG_AGE_UNKNOWN : hal_time_ms() - rec.time);
+
+	return 0;
+}
+
+void knot_thing_log_pop(struct knot_thing_log *log)
+{
+	uint8_t state = LOG_SENT;
+
+	if (log->count == 0)
+		return;
+
+	hal_storage_write(slot_addr(log->tail), &state, sizeof(state));
+
+	log->tail = (log->tail + 1) % LOG_SLOTS;
+	log->count--;
+	if (log->stale)
+		log->stale--;
+}
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#ifndef __KNOT_THING_LOG_H__
+#define __KNOT_THING_LOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "knot_protocol.h"
+#include "knot_thing_config.h"
+
+/*
+ * Store and forward log of readings, on the KNOT_THING_LOG_SIZE bytes of
+ * HAL storage from KNOT_THING_LOG_ADDR on. Records are written in turn
+ * around a ring of fixed size slots, so wear is spread evenly over the
+ * area. Head and tail are only kept in RAM and found again at init by
+ * scanning the records, instead of being rewritten in a storage cell of
+ * their own on every reading. Each record has a sequence number and a
+ * CRC-8, so one torn by a power loss is ignored, and uploading it only
+ * rewrites its state byte.
+ */
+struct knot_thing_log {
+	uint16_t	head;		// Slot the next record goes to
+	uint16_t	tail;		// Oldest slot not uploaded
+	uint16_t	count;		// Slots from tail to head
+	uint16_t	seq;		// Sequence number of the next record
+	uint16_t	stale;		// Oldest ones, logged before init
+};
+
+/* Recovers the records left in storage, uploaded first */
+void knot_thing_log_init(struct knot_thing_log *log);
+
+/* Logs a reading, dropping the oldest one if the log is full */
+int knot_thing_log_append(struct knot_thing_log *log,
+					const knot_msg_data *data);
+
+/*
+ * Reads the oldest reading not uploaded to data, and the ms elapsed since
+ * it was logged to age (KNOT_LOG_AGE_UNKNOWN if before init). Returns
+ * -ENOENT if there is none.
+ */
+int knot_thing_log_peek(struct knot_thing_log *log, knot_msg_data *data,
+							uint32_t *age);
+
+/* Marks the reading returned by knot_thing_log_peek() as uploaded */
+void knot_thing_log_pop(struct knot_thing_log *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __KNOT_THING_LOG_H__ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "knot_thing_config.h"
+#include "knot_thing_lz.h"
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+
+#define LZ_HASH_SIZE			16
+#define LZ_MIN_MATCH			3
+#define LZ_MAX_LITERALS			32
+
+static inline uint8_t lz_hash(const uint8_t *p)
+{
+	return ((p[0] << 2) ^ (p[1] << 1) ^ p[2]) % LZ_HASH_SIZE;
+}
+
+/* Writes the literals in runs of up to LZ_MAX_LITERALS, 0 if no room */
+static uint8_t lz_literals(const uint8_t *in, uint8_t len, uint8_t *out,
+							uint8_t room)
+{
+	uint8_t run, pos = 0;
+
+	while (len > 0) {
+		run = (len < LZ_MAX_LITERALS ? len : LZ_MAX_LITERALS);
+		if (pos + 1 + run > room)
+			return 0;
+
+		out[pos++] = run - 1;
+		memcpy(out + pos, in, run);
+		pos += run;
+		in += run;
+		len -= run;
+	}
+
+	return pos;
+}
+
+uint8_t knot_thing_lz_compress(const uint8_t *in, uint8_t in_len,
+					uint8_t *out, uint8_t out_len)
+{
+	uint8_t table[LZ_HASH_SIZE];	// Position + 1, 0 if none
+	uint8_t ip = 0, lit = 0, op = 0, ref, len, dist, n;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= in_len) {
+		n = lz_hash(in + ip);
+		ref = table[n];
+		table[n] = ip + 1;
+
+		if (ref == 0 || memcmp(in + ref - 1, in + ip, LZ_MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+
+		/* Inputs are under 256 bytes: so are lengths and distances */
+		ref--;
+		for (len = LZ_MIN_MATCH; ip + len < in_len &&
+				in[ref + len] == in[ip + len]; len++)
+			;
+
+		if (ip > lit) {
+			n = lz_literals(in + lit, ip - lit, out + op,
+								out_len - op);
+			if (n == 0)
+				return 0;
+			op += n;
+		}
+
+		dist = ip - ref - 1;
+		len -= 2;
+		if (op + (len < 7 ? 2 : 3) > out_len)
+			return 0;
+
+		if (len < 7)
+			out[op++] = len << 5;
+		else {
+			out[op++] = 7 << 5;
+			out[op++] = len - 7;
+		}
+		out[op++] = dist;
+
+		ip += len + 2;
+		lit = ip;
+	}
+
+	if (in_len > lit) {
+		n = lz_literals(in + lit, in_len - lit, out + op,
+							out_len - op);
+		if (n == 0)
+			return 0;
+		op += n;
+	}
+
+	return op;
+}
+
+#endif
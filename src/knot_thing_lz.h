@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#ifndef __KNOT_THING_LZ_H__
+#define __KNOT_THING_LZ_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * LZF compression of small buffers, for stream fragments (see
+ * KNOT_MSG_DATA_STREAM): matches are searched through a 16 entries hash
+ * table on the stack, so it needs neither heap nor a window beyond the
+ * input. Returns the compressed length, or 0 if it does not fit in out_len
+ * bytes.
+ */
+uint8_t knot_thing_lz_compress(const uint8_t *in, uint8_t in_len,
+					uint8_t *out, uint8_t out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __KNOT_THING_LZ_H__ */
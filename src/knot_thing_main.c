@@ -8,6 +8,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -16,62 +17,128 @@
 #include "knot_thing_config.h"
 #include "knot_types.h"
 #include "knot_thing_main.h"
+#include "knot_thing_trace.h"
+#include "knot_thing_lz.h"
 
 // TODO: normalize all returning error codes
 
 #define KNOT_THING_EMPTY_ITEM		"EMPTY ITEM"
 
-/* Keeps track of max data_items index were there is a sensor/actuator stored */
-static uint8_t max_sensor_id;
-static uint8_t evt_sensor_id;
-
-static struct _data_items{
-	// schema values
-	uint8_t			value_type;	// KNOT_VALUE_TYPE_* (int, float, bool, raw)
-	uint8_t			unit;		// KNOT_UNIT_*
-	uint16_t		type_id;	// KNOT_TYPE_ID_*
-	const char		*name;		// App defined data item name
-	// data values
-	knot_value_types	last_data;
-	uint8_t			*last_value_raw;
-	// config values
-	knot_config		config;	// Flags indicating when data will be sent
-	// time values
-	uint32_t		last_timeout;	// Stores the last time the data was sent
-	// Data read/write functions
-	knot_data_functions	functions;
-} data_items[KNOT_THING_DATA_MAX];
-
-static void reset_data_items(void)
+/* FNV-1a hash of the registered schema, see knot_thing_protocol.h */
+#define FNV_OFFSET_BASIS		2166136261UL
+#define FNV_PRIME			16777619UL
+
+/* The thing a protocol context is embedded in */
+#define thing_ctx(_proto)						\
+	((struct knot_thing_ctx *) ((uint8_t *) (_proto) -		\
+				offsetof(struct knot_thing_ctx, proto)))
+
+/* Thing driven by the knot_thing_*() functions */
+static struct knot_thing_ctx thing;
+
+static void reset_data_items(struct knot_thing_ctx *ctx)
 {
+	struct _data_items *items = &ctx->data_items;
+	struct _data_items_schema *schema = ctx->data_items_schema;
 	int8_t count;
-	max_sensor_id = 0;
-	evt_sensor_id = 0;
-	struct _data_items *pdata = data_items;
-
-	for (count = 0; count < KNOT_THING_DATA_MAX; ++count, ++pdata) {
-		pdata->name					= KNOT_THING_EMPTY_ITEM;
-		pdata->type_id					= KNOT_TYPE_ID_INVALID;
-		pdata->unit					= KNOT_UNIT_NOT_APPLICABLE;
-		pdata->value_type				= KNOT_VALUE_TYPE_INVALID;
-		pdata->config.event_flags			= KNOT_EVT_FLAG_UNREGISTERED;
-		/* As "last_data" is a union, we need just to set the "biggest" member*/
-		pdata->last_data.val_f.multiplier		= 1;
-		pdata->last_data.val_f.value_int		= 0;
-		pdata->last_data.val_f.value_dec		= 0;
-		/* As "lower_limit" is a union, we need just to set the "biggest" member */
-		pdata->config.lower_limit.val_f.multiplier	= 1;
-		pdata->config.lower_limit.val_f.value_int	= 0;
-		pdata->config.lower_limit.val_f.value_dec	= 0;
-		/* As "upper_limit" is a union, we need just to set the "biggest" member */
-		pdata->config.upper_limit.val_f.multiplier	= 1;
-		pdata->config.upper_limit.val_f.value_int	= 0;
-		pdata->config.upper_limit.val_f.value_dec	= 0;
-		pdata->last_value_raw				= NULL;
+
+	ctx->item_count = 0;
+	ctx->sched_len = 0;
+	items->limits_len = 0;
+	items->aggregate_len = 0;
+	ctx->schema_fingerprint = FNV_OFFSET_BASIS;
+
+	for (count = 0; count < KNOT_THING_DATA_MAX; ++count) {
+		schema[count].name			= KNOT_THING_EMPTY_ITEM;
+		schema[count].type_id			= KNOT_TYPE_ID_INVALID;
+		schema[count].unit			= KNOT_UNIT_NOT_APPLICABLE;
+		items->value_type[count]		= KNOT_VALUE_TYPE_INVALID;
+		items->event_flags[count]		= KNOT_EVT_FLAG_UNREGISTERED;
+#if KNOT_THING_COMPACT_ENCODING
+		items->sent_valid[count]		= 0;
+		items->sent_raw[count]			= NULL;
+#endif
+		items->async[count].start		= NULL;
+		items->converting[count]		= 0;
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+		items->stream_read[count]		= NULL;
+#endif
 		/* As "functions" is a union, we need just to set only one of its members */
-		pdata->functions.int_f.read			= NULL;
-		pdata->functions.int_f.write			= NULL;
+		items->functions[count].int_f.read	= NULL;
+		items->functions[count].int_f.write	= NULL;
+	}
+}
+
+/* Moves an item between slots, used to keep the table sorted */
+static void item_move(struct knot_thing_ctx *ctx, uint8_t to, uint8_t from)
+{
+	struct _data_items *items = &ctx->data_items;
+
+	ctx->data_items_schema[to]	= ctx->data_items_schema[from];
+	items->sensor_id[to]		= items->sensor_id[from];
+	items->value_type[to]		= items->value_type[from];
+	items->event_flags[to]		= items->event_flags[from];
+	items->time_sec[to]		= items->time_sec[from];
+	items->multiplier[to]		= items->multiplier[from];
+	items->limits[to]		= items->limits[from];
+	items->aggregate[to]		= items->aggregate[from];
+	items->state[to]		= items->state[from];
+	items->last_value[to]		= items->last_value[from];
+	items->last_timeout[to]		= items->last_timeout[from];
+	items->next_due[to]		= items->next_due[from];
+	items->functions[to]		= items->functions[from];
+	items->async[to]		= items->async[from];
+	items->converting[to]		= items->converting[from];
+#if KNOT_THING_COMPACT_ENCODING
+	items->sent_data[to]		= items->sent_data[from];
+	items->sent_valid[to]		= items->sent_valid[from];
+	items->sent_raw[to]		= items->sent_raw[from];
+	items->sent_deltas[to]		= items->sent_deltas[from];
+#endif
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	items->stream_read[to]		= items->stream_read[from];
+	items->stream_flags[to]		= items->stream_flags[from];
+#endif
+	ctx->item_stats[to]		= ctx->item_stats[from];
+}
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t *data, uint8_t len)
+{
+	while (len--) {
+		hash ^= *data++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/* Only recomputed on registration: authentication just reads it */
+static void update_fingerprint(struct knot_thing_ctx *ctx)
+{
+	struct _data_items_schema *schema = ctx->data_items_schema;
+	uint32_t hash = FNV_OFFSET_BASIS;
+	uint8_t slot, fields[5];
+	const char *name;
+
+	for (slot = 0; slot < ctx->item_count; slot++) {
+		fields[0] = ctx->data_items.sensor_id[slot];
+		fields[1] = schema[slot].type_id & 0xff;
+		fields[2] = schema[slot].type_id >> 8;
+		fields[3] = ctx->data_items.value_type[slot];
+		fields[4] = schema[slot].unit;
+		hash = fnv1a(hash, fields, sizeof(fields));
+
+		name = schema[slot].name;
+		hash = fnv1a(hash, (const uint8_t *) name,
+				strnlen(name, KNOT_PROTOCOL_DATA_NAME_LEN));
 	}
+
+	ctx->schema_fingerprint = hash;
+}
+
+static uint32_t data_items_fingerprint(struct knot_thing_protocol *proto)
+{
+	return thing_ctx(proto)->schema_fingerprint;
 }
 
 int data_function_is_valid(knot_data_functions *func)
@@ -85,347 +152,1784 @@ int data_function_is_valid(knot_data_functions *func)
 	return 0;
 }
 
-uint8_t item_is_unregistered(uint8_t sensor_id)
+/* Returns the slot of sensor_id, or -1 if not registered */
+static int8_t item_slot(struct knot_thing_ctx *ctx, uint8_t sensor_id)
+{
+	uint8_t low = 0, high = ctx->item_count, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (ctx->data_items.sensor_id[mid] < sensor_id)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < ctx->item_count &&
+			ctx->data_items.sensor_id[low] == sensor_id)
+		return low;
+
+	return -1;
+}
+
+/* Wrap safe: true if time 'a' comes before time 'b' */
+static inline uint8_t time_before(uint32_t a, uint32_t b)
+{
+	return ((int32_t) (a - b) < 0);
+}
+
+/*
+ * Sampling period of an item: change and threshold events (and raw items,
+ * which always report changes) are polled every KNOT_THING_POLL_MS, time
+ * events every time_sec and aggregated items every period of their
+ * aggregation. Zero means the item is never sampled.
+ */
+static uint32_t item_period(struct knot_thing_ctx *ctx, uint8_t slot)
+{
+	struct _data_items *items = &ctx->data_items;
+	uint8_t flags = items->event_flags[slot];
+	uint32_t period = 0, time_ms;
+
+	if (flags & KNOT_EVT_FLAG_UNREGISTERED)
+		return 0;
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	/* Sent on demand only */
+	if (items->stream_read[slot])
+		return 0;
+#endif
+
+	if (items->aggregate[slot] != KNOT_THING_NO_ENTRY &&
+			items->aggregate_pool[items->aggregate[slot]].window)
+		return items->aggregate_pool[items->aggregate[slot]].period;
+
+	if ((flags & (KNOT_EVT_FLAG_CHANGE | KNOT_EVT_FLAG_LOWER_THRESHOLD |
+		KNOT_EVT_FLAG_UPPER_THRESHOLD)) ||
+		items->value_type[slot] == KNOT_VALUE_TYPE_RAW)
+		period = KNOT_THING_POLL_MS;
+
+	if (flags & KNOT_EVT_FLAG_TIME) {
+		time_ms = (uint32_t) items->time_sec[slot] * 1000;
+		if (period == 0 || time_ms < period)
+			period = (time_ms ? time_ms : 1);
+	}
+
+	return period;
+}
+
+static void sched_sift_down(struct knot_thing_ctx *ctx, uint8_t pos)
+{
+	uint32_t *next_due = ctx->data_items.next_due;
+	uint8_t *heap = ctx->sched_heap;
+	uint8_t child, tmp;
+
+	while ((child = 2 * pos + 1) < ctx->sched_len) {
+		if (child + 1 < ctx->sched_len &&
+			time_before(next_due[heap[child + 1]],
+				next_due[heap[child]]))
+			child++;
+
+		if (!time_before(next_due[heap[child]], next_due[heap[pos]]))
+			break;
+
+		tmp = heap[pos];
+		heap[pos] = heap[child];
+		heap[child] = tmp;
+		pos = child;
+	}
+}
+
+/*
+ * Rebuilds the heap from the item table. Only called when an item is
+ * registered or configured, so it does not need to be incremental.
+ */
+static void sched_rebuild(struct knot_thing_ctx *ctx)
+{
+	uint8_t slot, pos;
+
+	ctx->sched_len = 0;
+	for (slot = 0; slot < ctx->item_count; slot++) {
+		if (item_period(ctx, slot) == 0)
+			continue;
+
+		ctx->sched_heap[ctx->sched_len++] = slot;
+	}
+
+	for (pos = ctx->sched_len / 2; pos-- > 0; )
+		sched_sift_down(ctx, pos);
+}
+
+static void sched_item_now(struct knot_thing_ctx *ctx, uint8_t slot)
+{
+	ctx->data_items.next_due[slot] = hal_time_ms();
+	sched_rebuild(ctx);
+}
+
+void knot_thing_ctx_exit(struct knot_thing_ctx *ctx)
 {
-	return (!(data_items[sensor_id].config.event_flags & KNOT_EVT_FLAG_UNREGISTERED));
+	knot_thing_protocol_exit(&ctx->proto);
 }
 
 void knot_thing_exit(void)
 {
+	knot_thing_ctx_exit(&thing);
+}
+
+int8_t knot_thing_ctx_register_raw_data_item(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, const char *name, uint8_t *raw_buffer,
+	uint8_t raw_buffer_len, uint16_t type_id, uint8_t value_type,
+	uint8_t unit, knot_data_functions *func)
+{
+	if (raw_buffer != NULL && raw_buffer_len != KNOT_DATA_RAW_SIZE)
+		return -1;
 
+	if (knot_thing_ctx_register_data_item(ctx, sensor_id, name, type_id,
+		value_type, unit, func) != 0)
+		return -1;
+
+#if KNOT_THING_COMPACT_ENCODING
+	ctx->data_items.sent_raw[item_slot(ctx, sensor_id)] = raw_buffer;
+#endif
+
+	return 0;
 }
 
 int8_t knot_thing_register_raw_data_item(uint8_t sensor_id, const char *name,
 	uint8_t *raw_buffer, uint8_t raw_buffer_len, uint16_t type_id,
 	uint8_t value_type, uint8_t unit, knot_data_functions *func)
 {
-	if (raw_buffer == NULL)
-		return -1;
+	return knot_thing_ctx_register_raw_data_item(&thing, sensor_id, name,
+					raw_buffer, raw_buffer_len, type_id,
+					value_type, unit, func);
+}
 
-	if (raw_buffer_len != KNOT_DATA_RAW_SIZE)
-		return -1;
+/* Adds an item, func is checked by the caller */
+static int8_t item_register(struct knot_thing_ctx *ctx, uint8_t sensor_id,
+		const char *name, uint16_t type_id, uint8_t value_type,
+		uint8_t unit, knot_data_functions *func)
+{
+	struct _data_items *items = &ctx->data_items;
+	struct _data_items_schema *schema = ctx->data_items_schema;
+	uint8_t slot;
 
-	if (knot_thing_register_data_item(sensor_id, name, type_id, value_type,
-		unit, func) != 0)
+	if (ctx->item_count >= KNOT_THING_DATA_MAX ||
+		item_slot(ctx, sensor_id) >= 0 ||
+		(knot_schema_is_valid(type_id, value_type, unit) != 0) ||
+		name == NULL)
 		return -1;
 
-	data_items[sensor_id].last_value_raw	= raw_buffer;
+	/* Keep the table sorted: open a slot at sensor_id position */
+	for (slot = ctx->item_count; slot > 0 &&
+			items->sensor_id[slot - 1] > sensor_id; slot--)
+		item_move(ctx, slot, slot - 1);
+	ctx->item_count++;
+
+	schema[slot].name			= name;
+	schema[slot].type_id			= type_id;
+	schema[slot].unit			= unit;
+	items->sensor_id[slot]			= sensor_id;
+	items->value_type[slot]			= value_type;
+	// TODO: load flags and limits from persistent storage
+	/* Remove KNOT_EVT_FLAG_UNREGISTERED flag */
+	items->event_flags[slot]		= KNOT_EVT_FLAG_NONE;
+	items->time_sec[slot]			= 0;
+	items->multiplier[slot]			= 1;
+	items->limits[slot]			= KNOT_THING_NO_ENTRY;
+	items->aggregate[slot]			= KNOT_THING_NO_ENTRY;
+	items->state[slot]			= 0;
+	items->last_value[slot]			= 0;
+	items->last_timeout[slot]		= 0;
+	items->next_due[slot]			= 0;
+#if KNOT_THING_COMPACT_ENCODING
+	items->sent_valid[slot]			= 0;
+	items->sent_raw[slot]			= NULL;
+	items->sent_deltas[slot]		= 0;
+#endif
+	items->async[slot].start		= NULL;
+	items->converting[slot]			= 0;
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	items->stream_read[slot]		= NULL;
+#endif
+	/* As "functions" is a union, we need just to set only one of its members */
+	items->functions[slot].int_f.read	= func->int_f.read;
+	items->functions[slot].int_f.write	= func->int_f.write;
+	memset(&ctx->item_stats[slot], 0, sizeof(ctx->item_stats[slot]));
+
+	update_fingerprint(ctx);
+	sched_item_now(ctx, slot);
 
 	return 0;
 }
 
+int8_t knot_thing_ctx_register_data_item(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, const char *name, uint16_t type_id,
+	uint8_t value_type, uint8_t unit, knot_data_functions *func)
+{
+	if (data_function_is_valid(func) != 0)
+		return -1;
+
+	return item_register(ctx, sensor_id, name, type_id, value_type, unit,
+									func);
+}
 
 int8_t knot_thing_register_data_item(uint8_t sensor_id, const char *name,
 	uint16_t type_id, uint8_t value_type, uint8_t unit,
 	knot_data_functions *func)
 {
-	if (sensor_id >= KNOT_THING_DATA_MAX || (item_is_unregistered(sensor_id) != 0) ||
-		(knot_schema_is_valid(type_id, value_type, unit) != 0) ||
-		name == NULL || (data_function_is_valid(func) != 0))
+	return knot_thing_ctx_register_data_item(&thing, sensor_id, name,
+					type_id, value_type, unit, func);
+}
+
+int8_t knot_thing_ctx_register_async_read(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, knot_async_functions *async)
+{
+	int8_t slot = item_slot(ctx, sensor_id);
+
+	if (slot < 0 || async == NULL || async->start == NULL ||
+		async->ready == NULL)
 		return -1;
 
-	data_items[sensor_id].name					= name;
-	data_items[sensor_id].type_id					= type_id;
-	data_items[sensor_id].unit					= unit;
-	data_items[sensor_id].value_type				= value_type;
-	// TODO: load flags and limits from persistent storage
-	/* Remove KNOT_EVT_FLAG_UNREGISTERED flag */
-	data_items[sensor_id].config.event_flags			= KNOT_EVT_FLAG_NONE;
-	/* As "last_data" is a union, we need just to set the "biggest" member */
-	data_items[sensor_id].last_data.val_f.multiplier		= 1;
-	data_items[sensor_id].last_data.val_f.value_int			= 0;
-	data_items[sensor_id].last_data.val_f.value_dec			= 0;
-	/* As "lower_limit" is a union, we need just to set the "biggest" member */
-	data_items[sensor_id].config.lower_limit.val_f.multiplier	= 1;
-	data_items[sensor_id].config.lower_limit.val_f.value_int	= 0;
-	data_items[sensor_id].config.lower_limit.val_f.value_dec	= 0;
-	/* As "upper_limit" is a union, we need just to set the "biggest" member */
-	data_items[sensor_id].config.upper_limit.val_f.multiplier	= 1;
-	data_items[sensor_id].config.upper_limit.val_f.value_int	= 0;
-	data_items[sensor_id].config.upper_limit.val_f.value_dec	= 0;
-	data_items[sensor_id].last_value_raw				= NULL;
-	/* As "functions" is a union, we need just to set only one of its members */
-	data_items[sensor_id].functions.int_f.read			= func->int_f.read;
-	data_items[sensor_id].functions.int_f.write			= func->int_f.write;
+	ctx->data_items.async[slot] = *async;
+	ctx->data_items.converting[slot] = 0;
+
+	return 0;
+}
+
+int8_t knot_thing_register_async_read(uint8_t sensor_id,
+	knot_async_functions *async)
+{
+	return knot_thing_ctx_register_async_read(&thing, sensor_id, async);
+}
 
-	if (sensor_id > max_sensor_id)
-		max_sensor_id = sensor_id;
+int8_t knot_thing_ctx_register_stream_data_item(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, const char *name, uint16_t type_id, uint8_t unit,
+	knot_stream_functions *func, uint8_t flags)
+{
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	knot_data_functions raw;
+	int8_t slot;
+
+	if (func == NULL || func->read == NULL ||
+				(flags & ~KNOT_STREAM_FLAG_LZ))
+		return -1;
+
+	/* Only writes go through the raw functions */
+	raw.raw_f.read = NULL;
+	raw.raw_f.write = func->write;
+	if (item_register(ctx, sensor_id, name, type_id, KNOT_VALUE_TYPE_RAW,
+							unit, &raw) < 0)
+		return -1;
+
+	slot = item_slot(ctx, sensor_id);
+	ctx->data_items.stream_read[slot] = func->read;
+	ctx->data_items.stream_flags[slot] = flags;
+	sched_rebuild(ctx);
 
 	return 0;
+#else
+	return -1;
+#endif
 }
 
-int knot_thing_config_data_item(uint8_t sensor_id, uint8_t event_flags,
-	knot_value_types *lower_limit, knot_value_types *upper_limit)
+int8_t knot_thing_register_stream_data_item(uint8_t sensor_id,
+	const char *name, uint16_t type_id, uint8_t unit,
+	knot_stream_functions *func, uint8_t flags)
 {
-	if ((sensor_id >= KNOT_THING_DATA_MAX) || item_is_unregistered(sensor_id) == 0)
+	return knot_thing_ctx_register_stream_data_item(&thing, sensor_id, name,
+						type_id, unit, func, flags);
+}
+
+int8_t knot_thing_ctx_send_stream(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id)
+{
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	int8_t slot = item_slot(ctx, sensor_id);
+
+	if (slot < 0 || ctx->data_items.stream_read[slot] == NULL)
 		return -1;
 
-	data_items[sensor_id].config.event_flags = event_flags;
-	if (lower_limit != NULL) {
-		/* As "lower_limit" is a union, we need just to set the "biggest" member */
-		data_items[sensor_id].config.lower_limit.val_f.multiplier	= lower_limit->val_f.multiplier;
-		data_items[sensor_id].config.lower_limit.val_f.value_int	= lower_limit->val_f.value_int;
-		data_items[sensor_id].config.lower_limit.val_f.value_dec	= lower_limit->val_f.value_dec;
-	}
+	if (ctx->stream.active)
+		return -EBUSY;
+
+	ctx->stream.active = 1;
+	ctx->stream.sensor_id = sensor_id;
+	ctx->stream.id++;
+	ctx->stream.seq = 0;
+	ctx->stream.offset = 0;
+	ctx->stream.consumed = 0;
+	ctx->stream.last = 0;
 
-	if (upper_limit != NULL) {
-		/* As "upper_limit" is a union, we need just to set the "biggest" member */
-		data_items[sensor_id].config.upper_limit.val_f.multiplier	= upper_limit->val_f.multiplier;
-		data_items[sensor_id].config.upper_limit.val_f.value_int	= upper_limit->val_f.value_int;
-		data_items[sensor_id].config.upper_limit.val_f.value_dec	= upper_limit->val_f.value_dec;
-	}
-	// TODO: store flags and limits on persistent storage
 	return 0;
+#else
+	return -1;
+#endif
 }
 
-int knot_thing_create_schema(uint8_t i, knot_msg_schema *msg)
+int8_t knot_thing_send_stream(uint8_t sensor_id)
 {
-	knot_msg_schema entry;
+	return knot_thing_ctx_send_stream(&thing, sensor_id);
+}
 
-	memset(&entry, 0, sizeof(entry));
+/*
+ * Values and limits are compared as 32 bits integers in the scale of the
+ * readings of each item: val_i.value for int items, value_int.value_dec
+ * with KNOT_THING_FLOAT_DIGITS decimals for float ones, in units of the
+ * multiplier of the readings. Limits and filters are converted to that
+ * scale when configured, and again only if a reading comes with another
+ * multiplier, so a sample is checked with plain integer comparisons: no
+ * floating point and no 64 bits math on AVR.
+ *
+ * Configured values are kept as fixed point numbers with FIXED_DIGITS
+ * decimals: (value_int.value_dec) * multiplier, with value_dec digits
+ * read as the decimal part (5 is .5, 25 is .25). Each scale is computed
+ * from them, never from another scale, so rounding doesn't add up when a
+ * sensor switches multipliers back and forth.
+ *
+ * Multipliers are honoured with their sign everywhere; zero means unset
+ * and is taken as 1.
+ */
+#define FIXED_DIGITS			6
+#define FIXED_ONE			1000000L
 
-	msg->hdr.type = KNOT_MSG_SCHEMA;
+#define FLOAT_ONE			((int32_t) pow10[KNOT_THING_FLOAT_DIGITS])
+/* Largest value_int of a float item value, leaving room for decimals */
+#define FLOAT_INT_MAX			(INT32_MAX / FLOAT_ONE - 1)
 
-	if ((i >= KNOT_THING_DATA_MAX) || item_is_unregistered(i) == 0)
-		/*
-		 * FIXME
-		 * Check if this is the best error to be used from the defines
-		 * in the knot_protocol. Replace or create a better one if
-		 * needed.
-		 */
-		return KNOT_SCHEMA_EMPTY;
+static const uint32_t pow10[] = { 1UL, 10UL, 100UL, 1000UL, 10000UL,
+	100000UL, 1000000UL, 10000000UL, 100000000UL, 1000000000UL };
 
-	msg->sensor_id = i;
-	entry.values.value_type = data_items[i].value_type;
-	entry.values.unit = data_items[i].unit;
-	entry.values.type_id = data_items[i].type_id;
-	strncpy(entry.values.name, data_items[i].name,
-						sizeof(entry.values.name));
+/* value_dec as 'digits' digits, extra ones are truncated */
+static uint32_t dec_digits(uint32_t dec, uint8_t digits)
+{
+	uint8_t len = 1;
 
-	msg->hdr.payload_len = sizeof(entry.values) + sizeof(entry.sensor_id);
+	while (len < 10 && dec >= pow10[len])
+		len++;
 
-	memcpy(&msg->values, &entry.values, sizeof(msg->values));
-	/*
-	 * Every time a data item is registered we must update the max
-	 * number of sensor_id so we know when schema ends;
-	 */
-	if (i == max_sensor_id)
-		msg->hdr.type = KNOT_MSG_SCHEMA_END;
+	if (len > digits)
+		return dec / pow10[len - digits];
 
-	return KNOT_SUCCESS;
+	return dec * pow10[digits - len];
 }
 
-static int data_item_read(uint8_t sensor_id, knot_msg_data *data)
+/* Saturates instead of overflowing. A zero multiplier is taken as unset */
+static int64_t fixed_mul(int64_t value, int32_t multiplier)
 {
-	uint8_t len = 0, uint8_val = 0, uint8_buffer[KNOT_DATA_RAW_SIZE];
-	int32_t int32_val = 0, multiplier = 0;
-	uint32_t uint32_val = 0;
+	int64_t abs_value = (value < 0 ? -value : value);
+	int64_t abs_multiplier = (multiplier < 0 ? -(int64_t) multiplier :
+								multiplier);
 
-	if ((sensor_id >= KNOT_THING_DATA_MAX) || item_is_unregistered(sensor_id) == 0)
-		return -1;
+	if (multiplier == 0 || multiplier == 1)
+		return value;
 
-	switch (data_items[sensor_id].value_type) {
-	case KNOT_VALUE_TYPE_RAW:
-		if (data_items[sensor_id].functions.raw_f.read == NULL)
-			return -1;
-		if (data_items[sensor_id].functions.raw_f.read(uint8_buffer, &uint8_val) < 0)
-			return -1;
+	if (abs_value > INT64_MAX / abs_multiplier)
+		return ((value < 0) != (multiplier < 0) ? INT64_MIN :
+								INT64_MAX);
 
-		len = uint8_val;
-		memcpy(data->payload.raw, uint8_buffer, len);
-		data->hdr.payload_len = len;
-		break;
-	case KNOT_VALUE_TYPE_BOOL:
-		if (data_items[sensor_id].functions.bool_f.read == NULL)
-			return -1;
-		if (data_items[sensor_id].functions.bool_f.read(&uint8_val) < 0)
-			return -1;
+	return value * multiplier;
+}
 
-		len = sizeof(data->payload.values.val_b);
-		data->payload.values.val_b = uint8_val;
-		data->hdr.payload_len = len;
-		break;
-	case KNOT_VALUE_TYPE_INT:
-		if (data_items[sensor_id].functions.int_f.read == NULL)
-			return -1;
-		if (data_items[sensor_id].functions.int_f.read(&int32_val, &multiplier) < 0)
-			return -1;
+static int64_t fixed_value(uint8_t value_type, knot_value_types *value)
+{
+	int64_t fixed;
 
-		len = sizeof(data->payload.values.val_i);
-		data->payload.values.val_i.value = int32_val;
-		data->payload.values.val_i.multiplier = multiplier;
-		data->hdr.payload_len = len;
-		break;
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		fixed = (int64_t) value->val_i.value * FIXED_ONE;
+		return fixed_mul(fixed, value->val_i.multiplier);
 	case KNOT_VALUE_TYPE_FLOAT:
-		if (data_items[sensor_id].functions.float_f.read == NULL)
-			return -1;
+		fixed = (int64_t) value->val_f.value_int * FIXED_ONE;
+		/* The decimal part has the sign of the integer one */
+		if (value->val_f.value_int < 0)
+			fixed -= dec_digits(value->val_f.value_dec,
+							FIXED_DIGITS);
+		else
+			fixed += dec_digits(value->val_f.value_dec,
+							FIXED_DIGITS);
+		return fixed_mul(fixed, value->val_f.multiplier);
+	case KNOT_VALUE_TYPE_BOOL:
+		return (value->val_b ? FIXED_ONE : 0);
+	default:
+		return 0;
+	}
+}
 
-		if (data_items[sensor_id].functions.float_f.read(&int32_val, &uint32_val, &multiplier) < 0)
-			return -1;
+static int64_t fixed_abs(int64_t value)
+{
+	return (value < 0 ? (value == INT64_MIN ? INT64_MAX : -value) : value);
+}
 
-		len = sizeof(data->payload.values.val_f);
-		data->payload.values.val_f.value_int = int32_val;
-		data->payload.values.val_f.value_dec = uint32_val;
-		data->payload.values.val_f.multiplier = multiplier;
-		data->hdr.payload_len = len;
-		break;
-	default:
-		return -1;
-		break;
+static int32_t saturate32(int64_t value)
+{
+	if (value > INT32_MAX)
+		return INT32_MAX;
+
+	if (value < INT32_MIN)
+		return INT32_MIN;
+
+	return value;
+}
+
+/* value / unit (unit > 0), rounded down or up, saturated to 32 bits */
+static int32_t scale_div(int64_t value, int64_t unit, uint8_t round_up)
+{
+	int64_t quotient = value / unit;
+
+	/* Division truncates towards zero */
+	if (value % unit != 0) {
+		if (round_up && value > 0)
+			quotient++;
+		else if (!round_up && value < 0)
+			quotient--;
 	}
 
-	return 0;
+	return saturate32(quotient);
 }
 
-static int data_item_write(uint8_t sensor_id, knot_msg_data *data)
+/* Fixed point value of one unit of the item scale, without multiplier */
+static int32_t item_base(struct _data_items *items, uint8_t slot)
 {
-	uint8_t len;
+	if (items->value_type[slot] == KNOT_VALUE_TYPE_FLOAT)
+		return pow10[FIXED_DIGITS - KNOT_THING_FLOAT_DIGITS];
 
-	if ((sensor_id >= KNOT_THING_DATA_MAX) || item_is_unregistered(sensor_id) == 0)
-		return -1;
+	return FIXED_ONE;
+}
 
-	switch (data_items[sensor_id].value_type) {
-	case KNOT_VALUE_TYPE_RAW:
-		len = sizeof(data->payload.raw);
-		if (data_items[sensor_id].functions.raw_f.write == NULL)
-			return -1;
-		if (data_items[sensor_id].functions.raw_f.write(data->payload.raw, &len) < 0)
-			return -1;
+/* A value in the item scale as fixed point, saturated */
+static int64_t item_fixed(struct _data_items *items, uint8_t slot,
+					int64_t value, int32_t multiplier)
+{
+	return fixed_mul(value * item_base(items, slot), multiplier);
+}
 
-		break;
-	case KNOT_VALUE_TYPE_BOOL:
-		if (data_items[sensor_id].functions.bool_f.write == NULL)
-			return -1;
-		if (data_items[sensor_id].functions.bool_f.write(&data->payload.values.val_b) < 0)
-			return -1;
-		break;
-	case KNOT_VALUE_TYPE_INT:
-		if (data_items[sensor_id].functions.int_f.read == NULL)
-			return -1;
-		if (data_items[sensor_id].functions.int_f.write(&data->payload.values.val_i.value,
-								&data->payload.values.val_i.multiplier) < 0)
-			return -1;
-		break;
-	case KNOT_VALUE_TYPE_FLOAT:
-		if (data_items[sensor_id].functions.float_f.write == NULL)
-			return -1;
+/* Bool limits, kept in the item state next to the limit crossed */
+#define STATE_BOOL_LOWER		0x10
+#define STATE_BOOL_UPPER		0x20
+#define STATE_THRESHOLD			(KNOT_EVT_FLAG_LOWER_THRESHOLD | \
+						KNOT_EVT_FLAG_UPPER_THRESHOLD)
 
-		if (data_items[sensor_id].functions.float_f.write(&data->payload.values.val_f.value_int,
-								&data->payload.values.val_f.value_dec,
-								&data->payload.values.val_f.multiplier) < 0)
-			return -1;
-		break;
-	default:
-		return -1;
-	}
+static struct _data_items_limits *item_limits(struct _data_items *items,
+								uint8_t slot)
+{
+	if (items->limits[slot] == KNOT_THING_NO_ENTRY)
+		return NULL;
 
-	return 0;
+	return &items->limits_pool[items->limits[slot]];
 }
 
-int8_t knot_thing_run(void)
+/* Entry of an item, taken from the pool the first time. NULL if full */
+static struct _data_items_limits *limits_get(struct _data_items *items,
+								uint8_t slot)
 {
-	return knot_thing_protocol_run();
+	struct _data_items_limits *limits = item_limits(items, slot);
+
+	if (limits != NULL)
+		return limits;
+
+	if (items->limits_len >= KNOT_THING_LIMITS_MAX)
+		return NULL;
+
+	limits = &items->limits_pool[items->limits_len];
+	memset(limits, 0, sizeof(*limits));
+	limits->multiplier = items->multiplier[slot];
+	items->limits[slot] = items->limits_len++;
+
+	return limits;
 }
 
-int verify_events(knot_msg_data *data)
+/* Aggregation of an item, NULL if not aggregating */
+static struct _data_items_aggregate *item_aggregation(
+				struct _data_items *items, uint8_t slot)
 {
-	uint8_t err = 0, comparison = 0;
-	uint32_t current_time = hal_time_ms(); // update the time variable
+	struct _data_items_aggregate *agg;
 
-	/*
-	 * For all registered data items: verify if value
-	 * changed according to the events registered.
-	 */
+	if (items->aggregate[slot] == KNOT_THING_NO_ENTRY)
+		return NULL;
 
-	err = data_item_read(evt_sensor_id, data);
+	agg = &items->aggregate_pool[items->aggregate[slot]];
 
-	if (err < 0)
-		return -1;
-	/* Value did not change or error: return -1, 0 means send data */
-	if (data_items[evt_sensor_id].value_type == KNOT_VALUE_TYPE_RAW) {
+	return (agg->window ? agg : NULL);
+}
 
-		if (data_items[evt_sensor_id].last_value_raw == NULL)
-			return -1;
+/* value * from / to, rounded down or up */
+static int32_t rescale(int32_t value, int32_t from, int32_t to,
+							uint8_t round_up)
+{
+	return scale_div((int64_t) value * from, to, round_up);
+}
 
-		if (data->hdr.payload_len != KNOT_DATA_RAW_SIZE)
-			return -1;
+/*
+ * Precomputes what the samples of an item are compared with: the band
+ * around the last value reported that is not a change (the larger of the
+ * absolute and relative deadbands), and a hysteresis that keeps the
+ * limits minus or plus it within 32 bits. Called when configured, when a
+ * new value is reported and on a new multiplier, not on every sample.
+ */
+static void limits_update(struct _data_items *items, uint8_t slot,
+					struct _data_items_limits *limits)
+{
+	int32_t last = items->last_value[slot];
+	uint32_t abs_last;
+	uint16_t rel = limits->deadband_rel;
+	uint32_t band = 0;
+	int64_t room;
+
+	/* The relative deadband is in the scale of the limits */
+	if (items->multiplier[slot] != limits->multiplier)
+		last = rescale(last, items->multiplier[slot],
+						limits->multiplier, 0);
+	abs_last = (last < 0 ? 0U - (uint32_t) last : (uint32_t) last);
+
+	if (rel && abs_last / 1000 > (UINT32_MAX - UINT16_MAX) / rel)
+		band = UINT32_MAX;
+	else if (rel)
+		band = abs_last / 1000 * rel + abs_last % 1000 * rel / 1000;
+
+	if (band < (uint32_t) limits->deadband)
+		band = limits->deadband;
+
+	limits->band = band;
+
+	room = (int64_t) limits->upper_limit - INT32_MIN;
+	if (limits->hysteresis > room)
+		limits->hysteresis = room;
+
+	room = INT32_MAX - (int64_t) limits->lower_limit;
+	if (limits->hysteresis > room)
+		limits->hysteresis = room;
+}
 
-		if (memcmp(data_items[evt_sensor_id].last_value_raw, data->payload.raw, KNOT_DATA_RAW_SIZE) == 0)
-			return -1;
+/*
+ * Converts the configured limits and filters to the scale of readings
+ * with this multiplier. Samples beyond a limit cross it, so limits round
+ * towards the inside, deadband and hysteresis down. Runs when configured
+ * and when a reading comes with another multiplier than the previous
+ * one, which sensors seldom do.
+ */
+static void limits_scale(struct _data_items *items, uint8_t slot,
+		struct _data_items_limits *limits, int32_t multiplier)
+{
+	int64_t unit = (int64_t) multiplier * item_base(items, slot);
 
-		memcpy(data_items[evt_sensor_id].last_value_raw, data->payload.raw, KNOT_DATA_RAW_SIZE);
-		comparison = 1;
+	limits->multiplier = multiplier;
+	limits->lower_limit = scale_div(limits->lower_fixed, unit, 1);
+	limits->upper_limit = scale_div(limits->upper_fixed, unit, 0);
+	limits->deadband = scale_div(limits->deadband_fixed, unit, 0);
+	limits->hysteresis = scale_div(limits->hysteresis_fixed, unit, 0);
 
-	} else if (data_items[evt_sensor_id].value_type == KNOT_VALUE_TYPE_BOOL) {
-		if (data->payload.values.val_b != data_items[evt_sensor_id].last_data.val_b) {
-			comparison |= (KNOT_EVT_FLAG_CHANGE & data_items[evt_sensor_id].config.event_flags);
-			data_items[evt_sensor_id].last_data.val_b = data->payload.values.val_b;
-		}
+	limits_update(items, slot, limits);
+}
 
-	} else if (data_items[evt_sensor_id].value_type == KNOT_VALUE_TYPE_INT) {
-		// TODO: add multiplier to comparison
-
-		if (data->payload.values.val_i.value < data_items[evt_sensor_id].config.lower_limit.val_i.value)
-			comparison |= (KNOT_EVT_FLAG_LOWER_THRESHOLD & data_items[evt_sensor_id].config.event_flags);
-		else if (data->payload.values.val_i.value > data_items[evt_sensor_id].config.upper_limit.val_i.value)
-			comparison |= (KNOT_EVT_FLAG_UPPER_THRESHOLD & data_items[evt_sensor_id].config.event_flags);
-		if (data->payload.values.val_i.value != data_items[evt_sensor_id].last_data.val_i.value)
-			comparison |= (KNOT_EVT_FLAG_CHANGE & data_items[evt_sensor_id].config.event_flags);
-
-		data_items[evt_sensor_id].last_data.val_i.value = data->payload.values.val_i.value;
-		data_items[evt_sensor_id].last_data.val_i.multiplier = data->payload.values.val_i.multiplier;
-	} else if (data_items[evt_sensor_id].value_type == KNOT_VALUE_TYPE_FLOAT) {
-		// TODO: add multiplier and decimal part to comparison
-		if (data->payload.values.val_f.value_int <
-						data_items[evt_sensor_id].config.lower_limit.val_f.value_int)
-			comparison |= (KNOT_EVT_FLAG_LOWER_THRESHOLD & data_items[evt_sensor_id].config.event_flags);
-		else if (data->payload.values.val_f.value_int >
-						data_items[evt_sensor_id].config.upper_limit.val_f.value_int)
-			comparison |= (KNOT_EVT_FLAG_UPPER_THRESHOLD & data_items[evt_sensor_id].config.event_flags);
-		if (data->payload.values.val_f.value_int != data_items[evt_sensor_id].last_data.val_f.value_int)
-			comparison |= (KNOT_EVT_FLAG_CHANGE & data_items[evt_sensor_id].config.event_flags);
-
-		data_items[evt_sensor_id].last_data.val_f.value_int = data->payload.values.val_f.value_int;
-		data_items[evt_sensor_id].last_data.val_f.value_dec = data->payload.values.val_f.value_dec;
-		data_items[evt_sensor_id].last_data.val_f.multiplier = data->payload.values.val_f.multiplier;
-	} else {
-	// This data item is not registered with a valid value type
-		return -1;
+/*
+ * A sample in the item scale, saturated, and the multiplier of that
+ * scale: 32 bits math only. A negative multiplier is applied to the
+ * value, so the scale is always positive.
+ */
+static int32_t item_value(struct _data_items *items, uint8_t slot,
+				knot_value_types *value, int32_t *multiplier)
+{
+	int32_t val_int;
+	uint32_t dec;
+
+	switch (items->value_type[slot]) {
+	case KNOT_VALUE_TYPE_INT:
+		*multiplier = value->val_i.multiplier;
+		val_int = value->val_i.value;
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		*multiplier = value->val_f.multiplier;
+		val_int = value->val_f.value_int;
+		if (val_int > FLOAT_INT_MAX)
+			val_int = INT32_MAX;
+		else if (val_int < -FLOAT_INT_MAX)
+			val_int = INT32_MIN;
+		else {
+			dec = dec_digits(value->val_f.value_dec,
+						KNOT_THING_FLOAT_DIGITS);
+			/* The decimal part has the sign of the integer one */
+			val_int *= FLOAT_ONE;
+			val_int = (val_int < 0 ? val_int - (int32_t) dec :
+						val_int + (int32_t) dec);
+		}
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		*multiplier = 1;
+		return value->val_b;
+	default:
+		*multiplier = 1;
+		return 0;
 	}
 
-	/*
-	 * It is checked if the data is in time to be updated (time overflow).
-	 * If yes, the last timeout value and the comparison variable are updated with the time flag.
-	 */
-	if ((current_time - data_items[evt_sensor_id].last_timeout) >= data_items[evt_sensor_id].config.time_sec) {
-		data_items[evt_sensor_id].last_timeout = current_time;
-		comparison |= (KNOT_EVT_FLAG_TIME & data_items[evt_sensor_id].config.event_flags);
+	if (*multiplier == 0)
+		*multiplier = 1;
+	else if (*multiplier < 0) {
+		*multiplier = (*multiplier == INT32_MIN ? INT32_MAX :
+							-*multiplier);
+		val_int = (val_int == INT32_MIN ? INT32_MAX : -val_int);
 	}
 
-	/*
-	 * To avoid an extensive loop we keep an variable to iterate over all
-	 * sensors/actuators once at each loop. When the last sensor was verified
-	 * we reinitialize the counter, otherwise we just increment it.
-	 */
-	evt_sensor_id++;
+	return val_int;
+}
 
-	if (evt_sensor_id == max_sensor_id)
-		evt_sensor_id = 0;
+static void config_filter(struct _data_items *items, uint8_t slot,
+				struct _data_items_limits *limits,
+				knot_config_filter *filter)
+{
+	uint8_t value_type = items->value_type[slot];
+
+	limits->deadband_fixed = fixed_abs(fixed_value(value_type,
+							&filter->deadband));
+	limits->deadband_rel = filter->deadband_rel;
+	limits->hysteresis_fixed = fixed_abs(fixed_value(value_type,
+							&filter->hysteresis));
+	limits->min_interval = filter->min_interval;
+	/* The next event may be reported at once */
+	limits->last_report = hal_time_ms() - filter->min_interval;
+	items->state[slot] &= ~STATE_THRESHOLD;
+	limits_scale(items, slot, limits, limits->multiplier);
+}
 
-	// Nothing changed
-	if (comparison == 0)
+int8_t knot_thing_ctx_config_data_item_filter(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, knot_config_filter *filter)
+{
+	struct _data_items *items = &ctx->data_items;
+	struct _data_items_limits *limits;
+	int8_t slot = item_slot(ctx, sensor_id);
+
+	if (slot < 0 || filter == NULL)
+		return -1;
+
+	limits = limits_get(items, slot);
+	if (limits == NULL)
 		return -1;
 
-	// TODO: If something changed, create message
+	config_filter(items, slot, limits, filter);
 
 	return 0;
 }
 
-int8_t knot_thing_init(const char *thing_name)
+int8_t knot_thing_config_data_item_filter(uint8_t sensor_id,
+	knot_config_filter *filter)
+{
+	return knot_thing_ctx_config_data_item_filter(&thing, sensor_id,
+								filter);
+}
+
+static void aggregate_reset(struct _data_items_aggregate *agg,
+						uint32_t current_time)
+{
+	agg->start = current_time;
+	agg->count = 0;
+	agg->multiplier = 1;
+	agg->min = INT32_MAX;
+	agg->max = INT32_MIN;
+	agg->sum = 0;
+}
+
+int8_t knot_thing_ctx_config_data_item_aggregate(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, uint16_t period_ms, uint32_t window_ms)
+{
+	struct _data_items *items = &ctx->data_items;
+	struct _data_items_aggregate *agg;
+	int8_t slot = item_slot(ctx, sensor_id);
+
+	if (slot < 0 || items->value_type[slot] == KNOT_VALUE_TYPE_RAW)
+		return -1;
+
+	if (window_ms && (period_ms == 0 || window_ms < period_ms))
+		return -1;
+
+	/* The entry is kept when stopped, for the next window_ms */
+	if (items->aggregate[slot] == KNOT_THING_NO_ENTRY) {
+		if (window_ms == 0)
+			return 0;
+
+		if (items->aggregate_len >= KNOT_THING_AGGREGATE_MAX)
+			return -1;
+
+		items->aggregate[slot] = items->aggregate_len++;
+	}
+
+	agg = &items->aggregate_pool[items->aggregate[slot]];
+	agg->period = period_ms;
+	agg->window = window_ms;
+	aggregate_reset(agg, hal_time_ms());
+	sched_item_now(ctx, slot);
+
+	return 0;
+}
+
+int8_t knot_thing_config_data_item_aggregate(uint8_t sensor_id,
+	uint16_t period_ms, uint32_t window_ms)
+{
+	return knot_thing_ctx_config_data_item_aggregate(&thing, sensor_id,
+							period_ms, window_ms);
+}
+
+static int config_data_item(struct knot_thing_ctx *ctx, uint8_t sensor_id,
+				uint8_t event_flags,
+				knot_value_types *lower_limit,
+				knot_value_types *upper_limit,
+				knot_config_filter *filter)
+{
+	struct _data_items *items = &ctx->data_items;
+	struct _data_items_limits *limits;
+	int8_t slot = item_slot(ctx, sensor_id);
+	uint8_t value_type;
+
+	if (slot < 0)
+		return -1;
+
+	value_type = items->value_type[slot];
+
+	/* Only threshold events on int and float items need limits */
+	if (filter != NULL || ((event_flags & STATE_THRESHOLD) &&
+				(value_type == KNOT_VALUE_TYPE_INT ||
+				value_type == KNOT_VALUE_TYPE_FLOAT))) {
+		limits = limits_get(items, slot);
+		if (limits == NULL)
+			return -1;
+	} else
+		limits = item_limits(items, slot);
+
+	items->event_flags[slot] = event_flags;
+
+	if (value_type == KNOT_VALUE_TYPE_BOOL) {
+		items->state[slot] &= ~(STATE_BOOL_LOWER | STATE_BOOL_UPPER);
+		if (lower_limit != NULL && lower_limit->val_b)
+			items->state[slot] |= STATE_BOOL_LOWER;
+		if (upper_limit != NULL && upper_limit->val_b)
+			items->state[slot] |= STATE_BOOL_UPPER;
+	} else if (limits != NULL && value_type != KNOT_VALUE_TYPE_RAW) {
+		if (lower_limit != NULL)
+			limits->lower_fixed = fixed_value(value_type,
+								lower_limit);
+
+		if (upper_limit != NULL)
+			limits->upper_fixed = fixed_value(value_type,
+								upper_limit);
+	}
+
+	if (filter != NULL)
+		config_filter(items, slot, limits, filter);
+	else if (limits != NULL)
+		limits_scale(items, slot, limits, limits->multiplier);
+
+	sched_item_now(ctx, slot);
+
+	// TODO: store flags and limits on persistent storage
+	return 0;
+}
+
+static int data_item_config(struct knot_thing_protocol *proto,
+				uint8_t sensor_id, uint8_t event_flags,
+				knot_value_types *lower_limit,
+				knot_value_types *upper_limit,
+				knot_config_filter *filter)
+{
+	return config_data_item(thing_ctx(proto), sensor_id, event_flags,
+					lower_limit, upper_limit, filter);
+}
+
+int knot_thing_config_data_item(uint8_t sensor_id, uint8_t event_flags,
+	knot_value_types *lower_limit, knot_value_types *upper_limit)
+{
+	return config_data_item(&thing, sensor_id, event_flags, lower_limit,
+							upper_limit, NULL);
+}
+
+/* Builds the schema of the i-th registered item, in sensor_id order */
+static int create_schema(struct knot_thing_ctx *ctx, uint8_t i,
+						knot_msg_schema *msg)
+{
+	knot_msg_schema entry;
+
+	memset(&entry, 0, sizeof(entry));
+
+	msg->hdr.type = KNOT_MSG_SCHEMA;
+
+	if (i >= ctx->item_count)
+		/*
+		 * FIXME
+		 * Check if this is the best error to be used from the defines
+		 * in the knot_protocol. Replace or create a better one if
+		 * needed.
+		 */
+		return KNOT_SCHEMA_EMPTY;
+
+	msg->sensor_id = ctx->data_items.sensor_id[i];
+	entry.values.value_type = ctx->data_items.value_type[i];
+	entry.values.unit = ctx->data_items_schema[i].unit;
+	entry.values.type_id = ctx->data_items_schema[i].type_id;
+	strncpy(entry.values.name, ctx->data_items_schema[i].name,
+						sizeof(entry.values.name));
+
+	msg->hdr.payload_len = sizeof(entry.values) + sizeof(entry.sensor_id);
+
+	memcpy(&msg->values, &entry.values, sizeof(msg->values));
+	/* The last registered item ends the schema */
+	if (i == ctx->item_count - 1)
+		msg->hdr.type = KNOT_MSG_SCHEMA_END;
+
+	return KNOT_SUCCESS;
+}
+
+static int data_item_schema(struct knot_thing_protocol *proto, uint8_t i,
+							knot_msg_schema *msg)
+{
+	return create_schema(thing_ctx(proto), i, msg);
+}
+
+int knot_thing_create_schema(uint8_t i, knot_msg_schema *msg)
+{
+	return create_schema(&thing, i, msg);
+}
+
+static int item_read_value(struct knot_thing_ctx *ctx, uint8_t slot,
+							knot_msg_data *data)
+{
+	knot_data_functions *functions = &ctx->data_items.functions[slot];
+	uint8_t len = 0, uint8_val = 0;
+	int32_t int32_val = 0, multiplier = 0;
+	uint32_t uint32_val = 0;
+
+	switch (ctx->data_items.value_type[slot]) {
+	case KNOT_VALUE_TYPE_RAW:
+		if (functions->raw_f.read == NULL)
+			return -1;
+		/* Read in place, straight into the frame to send */
+		if (functions->raw_f.read(data->payload.raw, &uint8_val) < 0)
+			return -1;
+
+		if (uint8_val > sizeof(data->payload.raw))
+			return -1;
+
+		len = uint8_val;
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		if (functions->bool_f.read == NULL)
+			return -1;
+		if (functions->bool_f.read(&uint8_val) < 0)
+			return -1;
+
+		len = sizeof(data->payload.values.val_b);
+		data->payload.values.val_b = uint8_val;
+		break;
+	case KNOT_VALUE_TYPE_INT:
+		if (functions->int_f.read == NULL)
+			return -1;
+		if (functions->int_f.read(&int32_val, &multiplier) < 0)
+			return -1;
+
+		len = sizeof(data->payload.values.val_i);
+		data->payload.values.val_i.value = int32_val;
+		data->payload.values.val_i.multiplier = multiplier;
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		if (functions->float_f.read == NULL)
+			return -1;
+
+		if (functions->float_f.read(&int32_val, &uint32_val, &multiplier) < 0)
+			return -1;
+
+		len = sizeof(data->payload.values.val_f);
+		data->payload.values.val_f.value_int = int32_val;
+		data->payload.values.val_f.value_dec = uint32_val;
+		data->payload.values.val_f.multiplier = multiplier;
+		break;
+	default:
+		return -1;
+		break;
+	}
+
+	data->hdr.type = KNOT_MSG_DATA;
+	data->sensor_id = ctx->data_items.sensor_id[slot];
+	data->hdr.payload_len = len + sizeof(data->sensor_id);
+
+	return 0;
+}
+
+static int item_read(struct knot_thing_ctx *ctx, uint8_t slot,
+							knot_msg_data *data)
+{
+	struct knot_thing_item_stats *stats = &ctx->item_stats[slot];
+	int err;
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_READ, ctx->data_items.sensor_id[slot]);
+	err = item_read_value(ctx, slot, data);
+	KNOT_TRACE_END(KNOT_TRACE_ID_READ, ctx->data_items.sensor_id[slot]);
+
+	stats->samples++;
+	if (err < 0) {
+		stats->read_errors++;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int data_item_read(struct knot_thing_protocol *proto,
+				uint8_t sensor_id, knot_msg_data *data)
+{
+	struct knot_thing_ctx *ctx = thing_ctx(proto);
+	int8_t slot = item_slot(ctx, sensor_id);
+
+	if (slot < 0)
+		return -1;
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	/* The blob follows as a stream, the reading itself is empty */
+	if (ctx->data_items.stream_read[slot]) {
+		if (knot_thing_ctx_send_stream(ctx, sensor_id) < 0 &&
+				ctx->stream.sensor_id != sensor_id)
+			return -1;
+
+		data->hdr.type = KNOT_MSG_DATA;
+		data->hdr.payload_len = sizeof(data->sensor_id);
+		data->sensor_id = sensor_id;
+		return 0;
+	}
+#endif
+
+	return item_read(ctx, slot, data);
+}
+
+static int item_write(struct knot_thing_ctx *ctx, uint8_t slot,
+							knot_msg_data *data)
+{
+	knot_data_functions *functions = &ctx->data_items.functions[slot];
+	uint8_t len;
+
+
+	switch (ctx->data_items.value_type[slot]) {
+	case KNOT_VALUE_TYPE_RAW:
+		len = sizeof(data->payload.raw);
+		if (functions->raw_f.write == NULL)
+			return -1;
+		if (functions->raw_f.write(data->payload.raw, &len) < 0)
+			return -1;
+
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		if (functions->bool_f.write == NULL)
+			return -1;
+		if (functions->bool_f.write(&data->payload.values.val_b) < 0)
+			return -1;
+		break;
+	case KNOT_VALUE_TYPE_INT:
+		if (functions->int_f.read == NULL)
+			return -1;
+		if (functions->int_f.write(&data->payload.values.val_i.value,
+						&data->payload.values.val_i.multiplier) < 0)
+			return -1;
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		if (functions->float_f.write == NULL)
+			return -1;
+
+		if (functions->float_f.write(&data->payload.values.val_f.value_int,
+						&data->payload.values.val_f.value_dec,
+						&data->payload.values.val_f.multiplier) < 0)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int data_item_write(struct knot_thing_protocol *proto,
+				uint8_t sensor_id, knot_msg_data *data)
+{
+	struct knot_thing_ctx *ctx = thing_ctx(proto);
+	int8_t slot = item_slot(ctx, sensor_id);
+	int err;
+
+	if (slot < 0)
+		return -1;
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_WRITE, sensor_id);
+	err = item_write(ctx, slot, data);
+	KNOT_TRACE_END(KNOT_TRACE_ID_WRITE, sensor_id);
+
+	ctx->item_stats[slot].writes++;
+	if (err < 0) {
+		ctx->item_stats[slot].write_errors++;
+		return -1;
+	}
+
+	return 0;
+}
+
+#if KNOT_THING_COMPACT_ENCODING
+/* Zigzag varint: small deltas of either sign take a single byte */
+static uint8_t put_varint(uint8_t *buffer, int32_t value)
+{
+	uint32_t zz = ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+	uint8_t len = 0;
+
+	while (zz >= 0x80) {
+		buffer[len++] = (zz & 0x7f) | 0x80;
+		zz >>= 7;
+	}
+	buffer[len++] = zz;
+
+	return len;
+}
+
+/*
+ * Raw delta: the ranges of bytes that changed since the value sent last,
+ * which raw_buffer keeps. Unchanged runs of up to 2 bytes are sent inside
+ * a range, as they cost no more than the offset and length of a new one.
+ */
+static int raw_delta(struct _data_items *items, int8_t slot,
+			knot_msg_data *data, uint8_t *buffer, uint8_t len)
+{
+	uint8_t *sent = items->sent_raw[slot];
+	uint8_t *value = data->payload.raw;
+	uint8_t value_len = data->hdr.payload_len - sizeof(data->sensor_id);
+	uint8_t pos = 1, i = 0, start, end, valid = items->sent_valid[slot];
+
+	/* Deltas don't grow nor shrink values */
+	if (value_len != KNOT_DATA_RAW_SIZE)
+		valid = 0;
+	else if (++items->sent_deltas[slot] >= KNOT_THING_RAW_REFRESH)
+		valid = 0;
+
+	/* Not shorter than the value itself: sent in full */
+	if (len > value_len - 1)
+		len = value_len - 1;
+
+	while (valid && i < value_len) {
+		if (value[i] == sent[i]) {
+			i++;
+			continue;
+		}
+
+		start = i;
+		end = ++i;
+		while (i < value_len && i - end <= 2) {
+			if (value[i] != sent[i])
+				end = i + 1;
+			i++;
+		}
+
+		if (pos + 2 + end - start > len) {
+			valid = 0;
+			break;
+		}
+
+		buffer[pos++] = start;
+		buffer[pos++] = end - start;
+		memcpy(buffer + pos, value + start, end - start);
+		pos += end - start;
+		i = end;
+	}
+
+	memcpy(sent, value, value_len);
+	items->sent_valid[slot] = (value_len == KNOT_DATA_RAW_SIZE);
+
+	if (!valid) {
+		items->sent_deltas[slot] = 0;
+		return 0;
+	}
+
+	buffer[0] = 0;
+
+	return pos;
+}
+
+/*
+ * Compact encoding of int and float readings: deltas against the last
+ * value sent (not last_value, which also holds readings that were never
+ * sent) and the multiplier only when it changed. Every call makes data
+ * the new reference, so a full reading also resynchronizes the item.
+ */
+static int data_item_encode(struct knot_thing_protocol *proto,
+			knot_msg_data *data, uint8_t *buffer, uint8_t len)
+{
+	struct knot_thing_ctx *ctx = thing_ctx(proto);
+	struct _data_items *items = &ctx->data_items;
+	knot_value_types *sent;
+	uint8_t flags = 0, pos = 1, valid;
+	int32_t multiplier;
+	int8_t slot;
+
+	if (data == NULL) {
+		memset(items->sent_valid, 0, sizeof(items->sent_valid));
+		return 0;
+	}
+
+	slot = item_slot(ctx, data->sensor_id);
+	if (slot < 0 || len < KNOT_COMPACT_MAX_LEN)
+		return -1;
+
+	sent = &items->sent_data[slot];
+	valid = items->sent_valid[slot];
+
+	if (items->value_type[slot] == KNOT_VALUE_TYPE_RAW) {
+		if (!(proto->encoding & KNOT_ENCODING_RAW_DELTA) ||
+					items->sent_raw[slot] == NULL)
+			return 0;
+
+		return raw_delta(items, slot, data, buffer, len);
+	}
+
+	if (!(proto->encoding & KNOT_ENCODING_COMPACT))
+		return 0;
+
+	switch (items->value_type[slot]) {
+	case KNOT_VALUE_TYPE_INT:
+		multiplier = data->payload.values.val_i.multiplier;
+		pos += put_varint(buffer + pos, (int32_t)
+				((uint32_t) data->payload.values.val_i.value -
+				(uint32_t) sent->val_i.value));
+		sent->val_i.value = data->payload.values.val_i.value;
+		if (multiplier != sent->val_i.multiplier) {
+			flags |= KNOT_COMPACT_FLAG_MULTIPLIER;
+			pos += put_varint(buffer + pos, multiplier);
+			sent->val_i.multiplier = multiplier;
+		}
+		break;
+	case KNOT_VALUE_TYPE_FLOAT:
+		multiplier = data->payload.values.val_f.multiplier;
+		pos += put_varint(buffer + pos, (int32_t)
+				((uint32_t) data->payload.values.val_f.value_int -
+				(uint32_t) sent->val_f.value_int));
+		sent->val_f.value_int = data->payload.values.val_f.value_int;
+		if (data->payload.values.val_f.value_dec !=
+						sent->val_f.value_dec) {
+			flags |= KNOT_COMPACT_FLAG_DEC;
+			pos += put_varint(buffer + pos, (int32_t)
+				(data->payload.values.val_f.value_dec -
+				sent->val_f.value_dec));
+			sent->val_f.value_dec =
+					data->payload.values.val_f.value_dec;
+		}
+		if (multiplier != sent->val_f.multiplier) {
+			flags |= KNOT_COMPACT_FLAG_MULTIPLIER;
+			pos += put_varint(buffer + pos, multiplier);
+			sent->val_f.multiplier = multiplier;
+		}
+		break;
+	default:
+		/* bool values have no compact form */
+		return 0;
+	}
+
+	items->sent_valid[slot] = 1;
+
+	/* First reading after a resync goes out in full */
+	if (!valid)
+		return 0;
+
+	buffer[0] = flags;
+
+	return pos;
+}
+#endif
+
+int32_t knot_thing_ctx_run(struct knot_thing_ctx *ctx)
+{
+	int32_t delay = knot_thing_protocol_run(&ctx->proto);
+
+	if (delay <= 0 || ctx->sleep == NULL)
+		return delay;
+
+	ctx->sleep(delay);
+
+	return 0;
+}
+
+int32_t knot_thing_run(void)
+{
+	return knot_thing_ctx_run(&thing);
+}
+
+void knot_thing_ctx_set_sleep(struct knot_thing_ctx *ctx, sleepFunction sleep)
 {
-	reset_data_items();
+	ctx->sleep = sleep;
+}
+
+void knot_thing_set_sleep(sleepFunction sleep)
+{
+	knot_thing_ctx_set_sleep(&thing, sleep);
+}
+
+/*
+ * Change filter: value must move away from the last value reported by
+ * more than the deadband, absolute and relative to that value (the
+ * band, see limits_update()). Without filters, any change counts.
+ */
+static uint8_t item_changed(struct _data_items *items, uint8_t slot,
+			struct _data_items_limits *limits, int32_t value,
+			int32_t multiplier)
+{
+	int32_t last = items->last_value[slot];
+	uint32_t band = (limits != NULL ? limits->band : 0);
+	uint32_t diff;
+	uint64_t wide;
+	int64_t a, b;
+
+	if (multiplier == items->multiplier[slot]) {
+		/* Wrap safe: the difference of two int32 fits in 32 bits */
+		diff = (value > last ? (uint32_t) value - (uint32_t) last :
+					(uint32_t) last - (uint32_t) value);
+
+		return (diff > band);
+	}
+
+	/* Reported with another multiplier: compared exactly, unscaled */
+	a = (int64_t) value * multiplier;
+	b = (int64_t) last * items->multiplier[slot];
+	wide = (a > b ? (uint64_t) a - (uint64_t) b :
+				(uint64_t) b - (uint64_t) a);
+
+	return (wide > (uint64_t) band * multiplier);
+}
+
+/*
+ * Returns the limit crossed by value, if any. With a hysteresis, a
+ * limit already crossed is not reported again until the value came back
+ * by more than it.
+ */
+static uint8_t item_thresholds(struct _data_items *items, uint8_t slot,
+			struct _data_items_limits *limits, int32_t value)
+{
+	/* Bounded by limits_update(): the limits +/- it don't wrap */
+	int32_t hysteresis = limits->hysteresis;
+	uint8_t crossed = 0, previous = items->state[slot] & STATE_THRESHOLD;
+
+	if (value < limits->lower_limit)
+		crossed = KNOT_EVT_FLAG_LOWER_THRESHOLD;
+	else if (value > limits->upper_limit)
+		crossed = KNOT_EVT_FLAG_UPPER_THRESHOLD;
+
+	if (hysteresis == 0)
+		return crossed;
+
+	if (previous == KNOT_EVT_FLAG_UPPER_THRESHOLD &&
+			value > limits->upper_limit - hysteresis)
+		return 0;
+
+	if (previous == KNOT_EVT_FLAG_LOWER_THRESHOLD &&
+			value < limits->lower_limit + hysteresis)
+		return 0;
+
+	items->state[slot] = (items->state[slot] & ~STATE_THRESHOLD) | crossed;
+
+	return crossed;
+}
+
+static int item_check_events(struct knot_thing_ctx *ctx, uint8_t slot,
+				knot_msg_data *data, uint32_t current_time)
+{
+	struct _data_items *items = &ctx->data_items;
+	struct _data_items_limits *limits = item_limits(items, slot);
+	uint8_t flags = items->event_flags[slot];
+	int8_t err = 0;
+	uint8_t comparison = 0;
+	int32_t value = 0, multiplier = 1;
+	uint32_t checksum = 0;
+
+	/* Too soon after the last report: don't even read the sensor */
+	if (limits != NULL &&
+		current_time - limits->last_report < limits->min_interval)
+		return -1;
+
+	/* Verify if value changed according to the events registered */
 
-	return knot_thing_protocol_init(thing_name, data_item_read,
-				data_item_write, knot_thing_create_schema,
-				knot_thing_config_data_item, verify_events);
+	err = item_read(ctx, slot, data);
+
+	if (err < 0)
+		return -1;
+	/* Value did not change or error: return -1, 0 means send data */
+	switch (items->value_type[slot]) {
+	case KNOT_VALUE_TYPE_RAW:
+		if (data->hdr.payload_len !=
+				KNOT_DATA_RAW_SIZE + sizeof(data->sensor_id))
+			return -1;
+
+		/*
+		 * Compared by checksum instead of against a copy of the last
+		 * value reported. The read rewrites the whole value, so every
+		 * byte has to be looked at once anyway.
+		 */
+		checksum = fnv1a(FNV_OFFSET_BASIS, data->payload.raw,
+							KNOT_DATA_RAW_SIZE);
+		if (checksum == items->last_checksum[slot])
+			return -1;
+
+		comparison = 1;
+		break;
+	case KNOT_VALUE_TYPE_BOOL:
+		value = data->payload.values.val_b;
+		if (value != items->last_value[slot])
+			comparison |= (KNOT_EVT_FLAG_CHANGE & flags);
+		break;
+	case KNOT_VALUE_TYPE_INT:
+	case KNOT_VALUE_TYPE_FLOAT:
+		value = item_value(items, slot, &data->payload.values,
+								&multiplier);
+
+		if (limits != NULL) {
+			if (multiplier != limits->multiplier)
+				limits_scale(items, slot, limits, multiplier);
+			comparison |= (item_thresholds(items, slot, limits,
+							value) & flags);
+		}
+		if (item_changed(items, slot, limits, value, multiplier))
+			comparison |= (KNOT_EVT_FLAG_CHANGE & flags);
+		break;
+	default:
+		// This data item is not registered with a valid value type
+		return -1;
+	}
+
+	/*
+	 * It is checked if the data is in time to be updated (time overflow).
+	 * If yes, the last timeout value and the comparison variable are updated with the time flag.
+	 */
+	if ((current_time - items->last_timeout[slot]) >=
+			(uint32_t) items->time_sec[slot] * 1000) {
+		items->last_timeout[slot] = current_time;
+		comparison |= (KNOT_EVT_FLAG_TIME & flags);
+	}
+
+	// Nothing changed
+	if (comparison == 0)
+		return -1;
+
+	/* Changes are measured from the last value reported */
+	if (items->value_type[slot] == KNOT_VALUE_TYPE_RAW)
+		items->last_checksum[slot] = checksum;
+	else {
+		items->last_value[slot] = value;
+		items->multiplier[slot] = multiplier;
+	}
+	if (limits != NULL) {
+		limits->last_report = current_time;
+		if (limits->deadband_rel)
+			limits_update(items, slot, limits);
+	}
+
+	return 0;
+}
+
+/* value / 10^(FIXED_DIGITS - decimals), saturated to 32 bits */
+static int32_t aggregate_value(int64_t value, uint8_t decimals)
+{
+	value /= (int64_t) pow10[FIXED_DIGITS - decimals];
+
+	if (value > INT32_MAX)
+		return INT32_MAX;
+
+	if (value < INT32_MIN)
+		return INT32_MIN;
+
+	return value;
+}
+
+/*
+ * Builds the summary of the current window in data. Once per window, so
+ * values go back to fixed point here, keeping the fraction of the mean.
+ */
+static void aggregate_summary(struct _data_items *items, uint8_t slot,
+		struct _data_items_aggregate *window, knot_msg_data *data)
+{
+	knot_data_aggregate *agg = (knot_data_aggregate *) data->payload.raw;
+	uint16_t count = window->count;
+	int64_t sum = window->sum;
+	int32_t multiplier = window->multiplier;
+	int64_t min = item_fixed(items, slot, window->min, multiplier);
+	int64_t max = item_fixed(items, slot, window->max, multiplier);
+	int64_t mean = item_fixed(items, slot, sum / count, multiplier);
+	int64_t bound = fixed_abs(min);
+	uint8_t decimals = FIXED_DIGITS;
+
+	/* Remainder, below one unit of the item scale */
+	mean += fixed_mul(sum % count * item_base(items, slot) / count,
+								multiplier);
+
+	/* The mean lies between min and max */
+	if (fixed_abs(max) > bound)
+		bound = fixed_abs(max);
+
+	while (decimals > 0 &&
+		bound / (int64_t) pow10[FIXED_DIGITS - decimals] > INT32_MAX)
+		decimals--;
+
+	agg->count = count;
+	agg->decimals = decimals;
+	agg->min = aggregate_value(min, decimals);
+	agg->max = aggregate_value(max, decimals);
+	agg->mean = aggregate_value(mean, decimals);
+
+	data->hdr.type = KNOT_MSG_DATA_AGGREGATE;
+	data->sensor_id = items->sensor_id[slot];
+	data->hdr.payload_len = sizeof(data->sensor_id) + sizeof(*agg);
+}
+
+/*
+ * The window is in the scale of its first sample: samples with another
+ * multiplier are converted to it, each one rounded once
+ */
+static void aggregate_add(struct _data_items_aggregate *agg, int32_t value,
+							int32_t multiplier)
+{
+	if (agg->count == 0)
+		agg->multiplier = multiplier;
+	else if (multiplier != agg->multiplier)
+		value = rescale(value, multiplier, agg->multiplier, 0);
+
+	if (value < agg->min)
+		agg->min = value;
+	if (value > agg->max)
+		agg->max = value;
+
+	/* Can't overflow: at most UINT16_MAX samples of 32 bits */
+	agg->sum += value;
+	agg->count++;
+}
+
+/*
+ * Samples an aggregated item. Returns 0 with the summary in data once
+ * its window is over, -1 otherwise. Windows without samples (the sensor
+ * always failed) are not reported.
+ */
+static int item_aggregate(struct knot_thing_ctx *ctx, uint8_t slot,
+				knot_msg_data *data, uint32_t current_time)
+{
+	struct _data_items *items = &ctx->data_items;
+	struct _data_items_aggregate *agg = item_aggregation(items, slot);
+	uint32_t window = agg->window, start;
+	uint8_t sampled = (item_read(ctx, slot, data) == 0);
+	int32_t value = 0, multiplier = 1;
+	int8_t err = -1;
+
+	if (sampled)
+		value = item_value(items, slot, &data->payload.values,
+								&multiplier);
+
+	if (current_time - agg->start < window && agg->count < UINT16_MAX) {
+		if (sampled)
+			aggregate_add(agg, value, multiplier);
+		return -1;
+	}
+
+	if (agg->count > 0) {
+		aggregate_summary(items, slot, agg, data);
+		err = 0;
+	}
+
+	/* The next window starts where this one ended, unless far behind */
+	start = agg->start + window;
+	if (current_time - start >= window)
+		start = current_time;
+	aggregate_reset(agg, start);
+
+	/* This sample opens the next window */
+	if (sampled)
+		aggregate_add(agg, value, multiplier);
+
+	return err;
+}
+
+/*
+ * Runs the split-phase read of an item that is due: starts a conversion,
+ * or polls the one in progress every KNOT_THING_ASYNC_POLL_MS. Returns 0
+ * once the reading can be fetched, -EAGAIN while converting (the item is
+ * due again at the next poll) or -EIO if the sensor failed.
+ */
+static int item_convert(struct knot_thing_ctx *ctx, uint8_t slot,
+						uint32_t current_time)
+{
+	struct _data_items *items = &ctx->data_items;
+	knot_async_functions *async = &items->async[slot];
+	int ready;
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_ASYNC, items->sensor_id[slot]);
+	if (!items->converting[slot]) {
+		ready = async->start();
+		if (ready >= 0) {
+			items->converting[slot] = 1;
+			ready = 0;
+		}
+	} else
+		ready = async->ready();
+	KNOT_TRACE_END(KNOT_TRACE_ID_ASYNC, items->sensor_id[slot]);
+
+	if (ready == 0) {
+		items->next_due[slot] = current_time +
+						KNOT_THING_ASYNC_POLL_MS;
+		return -EAGAIN;
+	}
+
+	items->converting[slot] = 0;
+
+	return (ready < 0 ? -EIO : 0);
+}
+
+static int check_events(struct knot_thing_ctx *ctx, knot_msg_data *data)
+{
+	uint32_t *next_due = ctx->data_items.next_due;
+	uint32_t current_time = hal_time_ms(); // update the time variable
+	uint32_t period;
+	uint8_t slot;
+	int err = 0;
+
+	if (ctx->sched_len == 0 ||
+		time_before(current_time, next_due[ctx->sched_heap[0]]))
+		return -1;
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_EVENTS, ctx->sched_len);
+
+	/*
+	 * Services the items that are due, earliest first, until one of
+	 * them has an event to send. Each serviced item is rescheduled one
+	 * period ahead, so calling again services the remaining due items.
+	 * A split-phase item is sampled once its conversion is done: until
+	 * then it is only polled, and the loop goes on with the others.
+	 */
+	while (ctx->sched_len > 0 &&
+		!time_before(current_time, next_due[ctx->sched_heap[0]])) {
+		slot = ctx->sched_heap[0];
+
+		if (ctx->data_items.async[slot].start != NULL) {
+			err = item_convert(ctx, slot, current_time);
+			if (err == -EAGAIN) {
+				sched_sift_down(ctx, 0);
+				continue;
+			}
+		}
+
+		period = item_period(ctx, slot);
+
+		next_due[slot] += period;
+		/* Fell behind more than a period: don't try to catch up */
+		if (!time_before(current_time, next_due[slot]))
+			next_due[slot] = current_time + period;
+
+		sched_sift_down(ctx, 0);
+
+		if (err < 0) {
+			err = 0;
+			continue;
+		}
+
+		if (item_aggregation(&ctx->data_items, slot))
+			err = item_aggregate(ctx, slot, data, current_time);
+		else
+			err = item_check_events(ctx, slot, data, current_time);
+
+		if (err == 0) {
+			ctx->item_stats[slot].events++;
+			KNOT_TRACE_END(KNOT_TRACE_ID_EVENTS, data->sensor_id);
+			return 0;
+		}
+		err = 0;
+	}
+
+	KNOT_TRACE_END(KNOT_TRACE_ID_EVENTS, 0);
+
+	// Nothing changed
+	return -1;
+}
+
+static int data_items_events(struct knot_thing_protocol *proto,
+							knot_msg_data *data)
+{
+	return check_events(thing_ctx(proto), data);
+}
+
+static int data_item_diag(struct knot_thing_protocol *proto,
+		uint8_t sensor_id, struct knot_thing_item_stats *stats)
+{
+	struct knot_thing_ctx *ctx = thing_ctx(proto);
+	int8_t slot = item_slot(ctx, sensor_id);
+
+	if (slot < 0)
+		return -1;
+
+	*stats = ctx->item_stats[slot];
+
+	return 0;
+}
+
+void knot_thing_ctx_get_stats(struct knot_thing_ctx *ctx,
+					struct knot_thing_stats *stats)
+{
+	uint8_t slot;
+
+	stats->proto = ctx->proto.stats;
+	stats->proto.state = ctx->proto.state;
+	stats->item_count = ctx->item_count;
+
+	for (slot = 0; slot < ctx->item_count; slot++) {
+		stats->items[slot].sensor_id = ctx->data_items.sensor_id[slot];
+		stats->items[slot].stats = ctx->item_stats[slot];
+	}
+}
+
+void knot_thing_get_stats(struct knot_thing_stats *stats)
+{
+	knot_thing_ctx_get_stats(&thing, stats);
+}
+
+static int32_t data_items_next(struct knot_thing_protocol *proto)
+{
+	struct knot_thing_ctx *ctx = thing_ctx(proto);
+	uint32_t due, current_time = hal_time_ms();
+
+	if (ctx->sched_len == 0)
+		return -1;
+
+	due = ctx->data_items.next_due[ctx->sched_heap[0]];
+
+	return (time_before(current_time, due) ? due - current_time : 0);
+}
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+/*
+ * Reads the fragment at the stream offset: compressed from up to
+ * KNOT_THING_STREAM_CHUNK bytes of the blob, or as is if that does not
+ * make it smaller or fit in a fragment.
+ */
+static int stream_fragment(struct knot_thing_ctx *ctx, uint8_t slot,
+					knot_msg_data_stream *msg)
+{
+	streamReadFunction read = ctx->data_items.stream_read[slot];
+	uint32_t offset = ctx->stream.offset;
+	uint8_t *chunk = ctx->stream.chunk;
+	uint8_t clen = 0, last;
+	int len;
+
+	ctx->item_stats[slot].samples++;
+
+	if (!(ctx->data_items.stream_flags[slot] & KNOT_STREAM_FLAG_LZ)) {
+		/* Read in place, straight into the fragment to send */
+		len = read(offset, msg->data, KNOT_THING_STREAM_FRAG_LEN);
+		if (len < 0)
+			return len;
+		if (len > KNOT_THING_STREAM_FRAG_LEN)
+			return -EINVAL;
+
+		msg->flags = 0;
+		ctx->stream.consumed = len;
+		ctx->stream.last = (len < KNOT_THING_STREAM_FRAG_LEN);
+		return len;
+	}
+
+	len = read(offset, chunk, KNOT_THING_STREAM_CHUNK);
+	if (len < 0)
+		return len;
+	if (len > KNOT_THING_STREAM_CHUNK)
+		return -EINVAL;
+
+	last = (len < KNOT_THING_STREAM_CHUNK);
+	if (len > 0)
+		clen = knot_thing_lz_compress(chunk, len, msg->data,
+						KNOT_THING_STREAM_FRAG_LEN);
+	if (clen > 0 && clen < len) {
+		msg->flags = KNOT_STREAM_FLAG_LZ;
+		ctx->stream.consumed = len;
+		ctx->stream.last = last;
+		return clen;
+	}
+
+	/* Incompressible: the bytes that fit, the rest goes next */
+	if (len > KNOT_THING_STREAM_FRAG_LEN) {
+		len = KNOT_THING_STREAM_FRAG_LEN;
+		last = 0;
+	}
+	memcpy(msg->data, chunk, len);
+	msg->flags = 0;
+	ctx->stream.consumed = len;
+	ctx->stream.last = last;
+
+	return len;
+}
+
+static int data_item_stream(struct knot_thing_protocol *proto,
+					knot_msg_data_stream *msg)
+{
+	struct knot_thing_ctx *ctx = thing_ctx(proto);
+	int8_t slot;
+	int len;
+
+	if (!ctx->stream.active)
+		return -1;
+
+	slot = item_slot(ctx, ctx->stream.sensor_id);
+
+	/* Sent: on to the next fragment */
+	if (msg == NULL) {
+		ctx->stream.offset += ctx->stream.consumed;
+		ctx->stream.seq++;
+		if (ctx->stream.last) {
+			ctx->stream.active = 0;
+			ctx->item_stats[slot].events++;
+		}
+		return 0;
+	}
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_STREAM, ctx->stream.sensor_id);
+	len = stream_fragment(ctx, slot, msg);
+	KNOT_TRACE_END(KNOT_TRACE_ID_STREAM, len < 0 ? 0 : len);
+
+	if (len < 0) {
+		ctx->item_stats[slot].read_errors++;
+		ctx->stream.active = 0;
+		return -1;
+	}
+
+	msg->hdr.type = KNOT_MSG_DATA_STREAM;
+	msg->hdr.payload_len = KNOT_STREAM_HDR_LEN - sizeof(msg->hdr) + len;
+	msg->sensor_id = ctx->stream.sensor_id;
+	msg->stream = ctx->stream.id;
+	msg->seq = ctx->stream.seq;
+	if (ctx->stream.last)
+		msg->flags |= KNOT_STREAM_FLAG_LAST;
+
+	return 0;
+}
+#endif
+
+int verify_events(knot_msg_data *data)
+{
+	return check_events(&thing, data);
+}
+
+int8_t knot_thing_ctx_init(struct knot_thing_ctx *ctx, const char *thing_name,
+								uint8_t flags)
+{
+	reset_data_items(ctx);
+	ctx->sleep = NULL;
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	ctx->stream.active = 0;
+	ctx->stream.id = 0;
+#endif
+
+	return knot_thing_protocol_init(&ctx->proto, thing_name, flags,
+				data_item_read, data_item_write,
+				data_item_schema, data_item_config,
+				data_items_events,
+#if KNOT_THING_COMPACT_ENCODING
+				data_item_encode,
+#else
+				NULL,
+#endif
+				data_items_fingerprint, data_items_next,
+				data_item_diag,
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+				data_item_stream);
+#else
+				NULL);
+#endif
+}
+
+int8_t knot_thing_init(const char *thing_name)
+{
+	return knot_thing_ctx_init(&thing, thing_name, 0);
 }
@@ -14,12 +14,17 @@
 extern "C" {
 #endif
 
+#include "knot_thing_config.h"
 #include "knot_thing_protocol.h"
 
 typedef int (*intDataFunction)		(int32_t *val, int32_t *multiplier);
 typedef int (*floatDataFunction)	(int32_t *val_int, uint32_t *val_dec, int32_t *multiplier);
 typedef int (*boolDataFunction)		(uint8_t *val);
 typedef int (*rawDataFunction)		(uint8_t *val, uint8_t *len);
+typedef int (*asyncStartFunction)	(void);
+typedef int (*asyncReadyFunction)	(void);
+typedef void (*sleepFunction)		(uint32_t ms);
+typedef int (*streamReadFunction)	(uint32_t offset, uint8_t *buf, uint8_t len);
 
 typedef struct __attribute__ ((packed)) {
 	intDataFunction read;
@@ -48,14 +53,270 @@ typedef union __attribute__ ((packed)) {
 	knot_raw_functions	raw_f;
 } knot_data_functions;
 
+/*
+ * Split-phase reads, for sensors whose conversion takes long (DHT22,
+ * one-wire): start begins a conversion and ready returns > 0 once it is
+ * done, 0 while converting or < 0 on error. The loop keeps running in
+ * between, and then fetches the result with the item read function. The
+ * read function must not block: it returns the last converted value,
+ * also when the GW asks for it.
+ */
+typedef struct __attribute__ ((packed)) {
+	asyncStartFunction start;
+	asyncReadyFunction ready;
+} knot_async_functions;
+
+/*
+ * Stream data items: raw items whose value is a blob of any size, sent
+ * as KNOT_MSG_DATA_STREAM fragments (see knot_thing_config.h to enable
+ * them). read pulls len bytes of the blob from offset on into buf and
+ * returns how many it read: less than len only at the end of the blob,
+ * < 0 on error, which drops the blob. The same offset may be read again
+ * and must give the same bytes until the blob is over, so it need not be
+ * kept in RAM. write, if any, gets raw values set by the GW.
+ */
+typedef struct __attribute__ ((packed)) {
+	streamReadFunction read;
+	rawDataFunction write;
+} knot_stream_functions;
+
+/*
+ * Data items are split in hot and cold parts. The hot part is what the
+ * main loop touches on every sample and is laid out as a struct of arrays,
+ * so verify_events() and the id lookup walk contiguous memory. Values and
+ * limits are stored as 32 bits integers in the scale of the readings of
+ * the item (see item_value()), not a full knot_value_types union per copy.
+ *
+ * Limits, filters and aggregation are only used by some items: they are
+ * kept in small pools, and items refer to their entry by index
+ * (KNOT_THING_NO_ENTRY if none). Bool limits are two bits of state.
+ */
+#define KNOT_THING_NO_ENTRY		0xff
+
+/* Limits of int and float items and event filters, see knot_config_filter */
+struct _data_items_limits {
+	// As configured, see fixed_value()
+	int64_t			lower_fixed;
+	int64_t			upper_fixed;
+	int64_t			deadband_fixed;
+	int64_t			hysteresis_fixed;
+	// Converted to the scale of the readings with this multiplier
+	int32_t			multiplier;
+	int32_t			lower_limit;
+	int32_t			upper_limit;
+	int32_t			deadband;
+	uint32_t		band;			// Deadband around last_value, both kinds
+	int32_t			hysteresis;
+	uint32_t		min_interval;
+	uint32_t		last_report;		// Last time an event was reported
+	uint16_t		deadband_rel;
+};
+
+/* Windowed aggregation, see knot_data_aggregate */
+struct _data_items_aggregate {
+	uint16_t		period;			// Sampling period (ms)
+	uint32_t		window;			// ms
+	uint32_t		start;
+	uint16_t		count;
+	int32_t			multiplier;		// Scale of min, max and sum
+	int32_t			min;
+	int32_t			max;
+	int64_t			sum;
+};
+
+struct _data_items {
+	uint8_t			sensor_id[KNOT_THING_DATA_MAX];
+	uint8_t			value_type[KNOT_THING_DATA_MAX];	// KNOT_VALUE_TYPE_*
+	// config values
+	uint8_t			event_flags[KNOT_THING_DATA_MAX];	// KNOT_EVT_FLAG_*
+	uint16_t		time_sec[KNOT_THING_DATA_MAX];
+	int32_t			multiplier[KNOT_THING_DATA_MAX];	// Scale of last_value
+	uint8_t			limits[KNOT_THING_DATA_MAX];		// Index in limits_pool
+	uint8_t			aggregate[KNOT_THING_DATA_MAX];		// Index in aggregate_pool
+	uint8_t			state[KNOT_THING_DATA_MAX];		// Limit crossed, bool limits
+	// data values
+	union {
+		int32_t		last_value[KNOT_THING_DATA_MAX];
+		uint32_t	last_checksum[KNOT_THING_DATA_MAX];	// Raw items
+	};
+	// time values
+	uint32_t		last_timeout[KNOT_THING_DATA_MAX];	// Last time the data was sent
+	uint32_t		next_due[KNOT_THING_DATA_MAX];		// Next time the item must be sampled
+	// Data read/write functions
+	knot_data_functions	functions[KNOT_THING_DATA_MAX];
+	// Split-phase read functions, start is NULL for plain reads
+	knot_async_functions	async[KNOT_THING_DATA_MAX];
+	uint8_t			converting[KNOT_THING_DATA_MAX];
+#if KNOT_THING_COMPACT_ENCODING
+	// Last value sent and known by the gateway, for compact encoding
+	knot_value_types	sent_data[KNOT_THING_DATA_MAX];
+	uint8_t			sent_valid[KNOT_THING_DATA_MAX];
+	uint8_t			*sent_raw[KNOT_THING_DATA_MAX];		// raw_buffer, owned by the library
+	uint8_t			sent_deltas[KNOT_THING_DATA_MAX];	// Raw deltas since a full value
+#endif
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	// Blob read function of stream items, NULL for the others
+	streamReadFunction	stream_read[KNOT_THING_DATA_MAX];
+	uint8_t			stream_flags[KNOT_THING_DATA_MAX];	// KNOT_STREAM_FLAG_LZ
+#endif
+	// Entries handed out in order, never freed: items can't be removed
+	struct _data_items_limits	limits_pool[KNOT_THING_LIMITS_MAX];
+	uint8_t			limits_len;
+	struct _data_items_aggregate	aggregate_pool[KNOT_THING_AGGREGATE_MAX];
+	uint8_t			aggregate_len;
+};
+
+/* Cold part: only read when registering and building the schema */
+struct _data_items_schema {
+	const char		*name;		// App defined data item name
+	uint16_t		type_id;	// KNOT_TYPE_ID_*
+	uint8_t			unit;		// KNOT_UNIT_*
+};
+
+/*
+ * One thing: its data items and protocol state. Contexts are independent,
+ * so a process may host many things; the memory of each one is
+ * sizeof(struct knot_thing_ctx), set by the KNOT_THING_* limits in
+ * knot_thing_config.h. Only access it through the knot_thing_ctx_*()
+ * functions.
+ */
+struct knot_thing_ctx {
+	struct knot_thing_protocol	proto;
+
+	/*
+	 * Registered items are stored compactly in slots [0..item_count),
+	 * sorted by sensor_id: any id (0-255) can be used and a sensor_id is
+	 * mapped to its slot by binary search.
+	 */
+	uint8_t				item_count;
+	struct _data_items		data_items;
+	struct _data_items_schema	data_items_schema[KNOT_THING_DATA_MAX];
+
+	/*
+	 * Items with events configured are kept in a min-heap keyed on the
+	 * time they are due to be sampled again, so each run only reads
+	 * items that are due, no matter how many are registered.
+	 */
+	uint8_t				sched_heap[KNOT_THING_DATA_MAX];
+	uint8_t				sched_len;
+
+	uint32_t			schema_fingerprint;
+
+	/* Counters of each data item, by slot */
+	struct knot_thing_item_stats	item_stats[KNOT_THING_DATA_MAX];
+
+	/* Platform sleep, NULL to return the delay to the caller instead */
+	sleepFunction			sleep;
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	/*
+	 * Blob being streamed, one at a time. The fragment is built from
+	 * offset until it is sent: chunk holds the blob bytes to compress.
+	 */
+	struct {
+		uint8_t			active;
+		uint8_t			sensor_id;
+		uint8_t			id;		// Stream number
+		uint16_t		seq;
+		uint32_t		offset;
+		uint8_t			consumed;	// By the fragment built
+		uint8_t			last;
+		uint8_t			chunk[KNOT_THING_STREAM_CHUNK];
+	} stream;
+#endif
+};
+
+/*
+ * Runtime counters of a thing, also sent to the GW on KNOT_MSG_GET_DIAG:
+ * state machine and link, then each data item in sensor_id order. They
+ * start at 0 on init and wrap around.
+ */
+struct knot_thing_stats {
+	struct knot_thing_protocol_stats	proto;
+	uint8_t					item_count;
+	struct {
+		uint8_t				sensor_id;
+		struct knot_thing_item_stats	stats;
+	} items[KNOT_THING_DATA_MAX];
+};
+
+/*
+ * Context API: same as the functions below, for the given thing. flags
+ * are KNOT_THING_NO_STORAGE or 0.
+ */
+int8_t	knot_thing_ctx_init(struct knot_thing_ctx *ctx, const char *thing_name,
+								uint8_t flags);
+void	knot_thing_ctx_exit(struct knot_thing_ctx *ctx);
+int32_t	knot_thing_ctx_run(struct knot_thing_ctx *ctx);
+void	knot_thing_ctx_set_sleep(struct knot_thing_ctx *ctx,
+							sleepFunction sleep);
+
+int8_t knot_thing_ctx_register_raw_data_item(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, const char *name, uint8_t *raw_buffer,
+	uint8_t raw_buffer_len, uint16_t type_id, uint8_t value_type,
+	uint8_t unit, knot_data_functions *func);
+
+int8_t knot_thing_ctx_register_data_item(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, const char *name, uint16_t type_id,
+	uint8_t value_type, uint8_t unit, knot_data_functions *func);
+
+int8_t knot_thing_ctx_register_async_read(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, knot_async_functions *async);
+
+int8_t knot_thing_ctx_register_stream_data_item(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, const char *name, uint16_t type_id, uint8_t unit,
+	knot_stream_functions *func, uint8_t flags);
+
+int8_t knot_thing_ctx_send_stream(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id);
+
+int8_t knot_thing_ctx_config_data_item_filter(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, knot_config_filter *filter);
+
+int8_t knot_thing_ctx_config_data_item_aggregate(struct knot_thing_ctx *ctx,
+	uint8_t sensor_id, uint16_t period_ms, uint32_t window_ms);
+
+void knot_thing_ctx_get_stats(struct knot_thing_ctx *ctx,
+					struct knot_thing_stats *stats);
+
 /* KNOT Thing main initialization functions and polling */
 int8_t	knot_thing_init(const char *thing_name);
 void	knot_thing_exit(void);
-int8_t	knot_thing_run(void);
+
+/*
+ * Runs the thing and returns the time (ms) until it has work to do again
+ * (a data item due, a retry, a frame to send), or < 0 if not running.
+ * Nothing is missed by calling it again only then, or sooner on radio RX.
+ */
+int32_t	knot_thing_run(void);
+
+/* Reads the runtime counters of the thing */
+void	knot_thing_get_stats(struct knot_thing_stats *stats);
+
+/*
+ * Makes knot_thing_run() sleep until the next work by itself, through the
+ * platform sleep function: it gets the time to sleep and may return
+ * sooner, e.g. on radio RX. Run then returns 0.
+ */
+void	knot_thing_set_sleep(sleepFunction sleep);
 
 /*
  * Data item (source/sink) registration functions
  */
+
+/*
+ * Raw read functions write the value straight into the payload of the
+ * frame to send, up to KNOT_DATA_RAW_SIZE bytes. Changes are detected by a
+ * checksum of the value.
+ *
+ * raw_buffer is optional (NULL). If given, it belongs to the library
+ * from then on: the last value sent to the GW is kept there, so that only
+ * the bytes that changed are sent when the GW asks for
+ * KNOT_ENCODING_RAW_DELTA (see KNOT_THING_COMPACT_ENCODING). The app must
+ * not write to it nor use it as a scratch buffer, which would corrupt the
+ * value the deltas are computed against, and must keep it allocated while
+ * the thing runs.
+ */
 int8_t knot_thing_register_raw_data_item(uint8_t sensor_id, const char *name,
 	uint8_t *raw_buffer, uint8_t raw_buffer_len, uint16_t type_id,
 	uint8_t value_type, uint8_t unit, knot_data_functions *func);
@@ -63,6 +324,42 @@ int8_t knot_thing_register_raw_data_item(uint8_t sensor_id, const char *name,
 int8_t knot_thing_register_data_item(uint8_t sensor_id, const char *name, uint16_t type_id,
 	uint8_t value_type, uint8_t unit, knot_data_functions *func);
 
+/* Makes the reads of a registered data item split-phase */
+int8_t knot_thing_register_async_read(uint8_t sensor_id,
+	knot_async_functions *async);
+
+/*
+ * Registers a stream data item, sent to the GW as a raw item. flags is
+ * KNOT_STREAM_FLAG_LZ to compress the fragments, or 0. Stream items are
+ * not sampled: a blob is sent when knot_thing_send_stream() is called or
+ * the GW asks for it.
+ */
+int8_t knot_thing_register_stream_data_item(uint8_t sensor_id,
+	const char *name, uint16_t type_id, uint8_t unit,
+	knot_stream_functions *func, uint8_t flags);
+
+/*
+ * Starts sending the blob of a stream item, from offset 0, once online.
+ * Returns -EBUSY while a blob is being sent.
+ */
+int8_t knot_thing_send_stream(uint8_t sensor_id);
+
+/*
+ * Sets the event filters of a data item, as KNOT_MSG_SET_CONFIG can do.
+ * Fails once KNOT_THING_LIMITS_MAX items have limits or filters.
+ */
+int8_t knot_thing_config_data_item_filter(uint8_t sensor_id,
+	knot_config_filter *filter);
+
+/*
+ * Samples a data item every period_ms and sends a summary of the samples
+ * every window_ms instead of its events. A zero window stops aggregating.
+ * Not available for raw items, and for at most KNOT_THING_AGGREGATE_MAX
+ * items.
+ */
+int8_t knot_thing_config_data_item_aggregate(uint8_t sensor_id,
+	uint16_t period_ms, uint32_t window_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,12 +10,14 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "knot_thing_config.h"
 #include "knot_thing_protocol.h"
+#include "knot_thing_trace.h"
 #include "include/avr_errno.h"
 #include "include/avr_unistd.h"
 #include "include/storage.h"
+#include "include/time.h"
 #include "include/comm.h"
-#include "include/nrf24.h"
 
 /*KNoT client storage mapping */
 #define KNOT_UUID_FLAG_ADDR		0
@@ -32,7 +34,7 @@
 #define STATE_REGISTERING		3
 #define STATE_SCHEMA			4
 #define STATE_SCHEMA_RESP		5
-#define STATE_ONLINE			6
+#define STATE_ONLINE			KNOT_THING_STATE_ONLINE
 #define STATE_ERROR			7
 #define STATE_MAX			(STATE_ERROR+1)
 
@@ -40,17 +42,25 @@
 #define MIN(a,b)			(((a) < (b)) ? (a) : (b))
 #endif
 
-static uint8_t enable_run = 0, schema_sensor_id = 0;
-static char uuid[KNOT_PROTOCOL_UUID_LEN];
-static char token[KNOT_PROTOCOL_TOKEN_LEN];
-static char device_name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
-static schema_function schemaf;
-static data_function thing_read;
-static data_function thing_write;
-static config_function configf;
-static int sock = -1;
-static events_function eventf;
-static int cli_sock = -1;
+/* A raw reading must fit, and the frame length in a uint8_t */
+#if KNOT_THING_BATCH_MTU > 0 && \
+	(KNOT_THING_BATCH_MTU < 20 || KNOT_THING_BATCH_MTU > 255)
+#error "KNOT_THING_BATCH_MTU must be 0 or 20 to 255"
+#endif
+
+#if KNOT_THING_BATCH_MTU > 0
+#define BATCH_HDR_LEN			sizeof(knot_msg_header)
+/* sensor_id and value length, followed by the value */
+#define BATCH_RECORD_HDR_LEN		2
+#endif
+
+/* Batch records are full readings: no encoding is ever applied */
+#if KNOT_THING_COMPACT_ENCODING && KNOT_THING_BATCH_MTU == 0
+#define ENCODINGS			(KNOT_ENCODING_COMPACT | \
+						KNOT_ENCODING_RAW_DELTA)
+#else
+#define ENCODINGS			KNOT_ENCODING_FULL
+#endif
 
 /*
  * FIXME: Thing address should be received via NFC
@@ -61,180 +71,413 @@ void set_nrf24MAC(struct nrf24_mac *mac)
 	uint8_t mac_mask = 4;
 	memset(mac, 0, sizeof(struct nrf24_mac));
 	hal_getrandom(mac->address.b + mac_mask,
-					sizeof(mac) - mac_mask);
+					sizeof(*mac) - mac_mask);
 	hal_storage_write_end(HAL_STORAGE_ID_MAC, mac, sizeof(*mac));
 }
 
-int knot_thing_protocol_init(const char *thing_name, data_function read,
-	data_function write, schema_function schema, config_function config,
-							events_function event)
+static inline int is_uuid(const char *string)
+{
+	return (string[0] != '\0' && string[8] == '-' &&
+		string[13] == '-' && string[18] == '-' && string[23] == '-');
+}
+
+static void load_identity(struct knot_thing_protocol *proto)
+{
+	struct nrf24_mac *mac = &proto->mac;
+	uint8_t mac_mask = 4;
+
+	memset(mac, 0, sizeof(*mac));
+	memset(proto->uuid, 0, sizeof(proto->uuid));
+	memset(proto->token, 0, sizeof(proto->token));
+
+	if (proto->flags & KNOT_THING_NO_STORAGE) {
+		hal_getrandom(mac->address.b + mac_mask,
+						sizeof(*mac) - mac_mask);
+		return;
+	}
+
+	hal_storage_read_end(HAL_STORAGE_ID_MAC, mac, sizeof(*mac));
+
+	/* No address stored yet: generate one, written only this time */
+	if (mac->address.uint64 == 0)
+		set_nrf24MAC(mac);
+
+	hal_storage_read_end(HAL_STORAGE_ID_UUID, proto->uuid,
+							sizeof(proto->uuid));
+	hal_storage_read_end(HAL_STORAGE_ID_TOKEN, proto->token,
+							sizeof(proto->token));
+}
+
+static void store_credentials(struct knot_thing_protocol *proto,
+				const char *new_uuid, const char *new_token)
+{
+	uint8_t persist = !(proto->flags & KNOT_THING_NO_STORAGE);
+
+	if (memcmp(proto->uuid, new_uuid, sizeof(proto->uuid)) != 0) {
+		memcpy(proto->uuid, new_uuid, sizeof(proto->uuid));
+		if (persist)
+			hal_storage_write_end(HAL_STORAGE_ID_UUID, proto->uuid,
+							sizeof(proto->uuid));
+	}
+
+	if (memcmp(proto->token, new_token, sizeof(proto->token)) != 0) {
+		memcpy(proto->token, new_token, sizeof(proto->token));
+		if (persist)
+			hal_storage_write_end(HAL_STORAGE_ID_TOKEN,
+					proto->token, sizeof(proto->token));
+	}
+}
+
+/* Link I/O, accounted in the protocol stats and traced */
+static ssize_t comm_write(struct knot_thing_protocol *proto,
+					const void *buffer, size_t count)
+{
+	ssize_t nbytes;
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_COMM_WRITE, *(const uint8_t *) buffer);
+	nbytes = hal_comm_write(proto->cli_sock, buffer, count);
+	KNOT_TRACE_END(KNOT_TRACE_ID_COMM_WRITE, nbytes < 0 ? 0 : nbytes);
+
+	if (nbytes == -EAGAIN)
+		proto->stats.tx_busy++;
+	else if (nbytes < 0)
+		proto->stats.tx_errors++;
+	else {
+		proto->stats.tx_frames++;
+		proto->stats.tx_bytes += nbytes;
+	}
+
+	return nbytes;
+}
+
+static ssize_t comm_read(struct knot_thing_protocol *proto, void *buffer,
+								size_t count)
+{
+	ssize_t nbytes;
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_COMM_READ, 0);
+	nbytes = hal_comm_read(proto->cli_sock, buffer, count);
+	KNOT_TRACE_END(KNOT_TRACE_ID_COMM_READ,
+				nbytes > 0 ? *(const uint8_t *) buffer : 0);
+
+	if (nbytes > 0) {
+		proto->stats.rx_frames++;
+		proto->stats.rx_bytes += nbytes;
+	}
+
+	return nbytes;
+}
+
+int knot_thing_protocol_init(struct knot_thing_protocol *proto,
+				const char *thing_name, uint8_t flags,
+				data_function read, data_function write,
+				schema_function schema, config_function config,
+				events_function event, encode_function encode,
+				fingerprint_function fingerprint,
+				next_function next, diag_function diag,
+				stream_function stream)
 {
 	int len;
 
+	memset(proto, 0, sizeof(*proto));
+	proto->sock = -1;
+	proto->cli_sock = -1;
+	proto->state = STATE_DISCONNECTED;
+	proto->previous_state = STATE_DISCONNECTED;
+	proto->encoding = KNOT_ENCODING_FULL;
+	proto->flags = flags;
+
 	if (hal_comm_init("NRF0") < 0)
 		return -1;
 
-	sock = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
-	if (sock < 0)
+	proto->sock = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
+	if (proto->sock < 0)
 		return -1;
-	memset(device_name, 0, sizeof(device_name));
 
-	len = MIN(strlen(thing_name), sizeof(device_name) - 1);
-	strncpy(device_name, thing_name, len);
-	enable_run = 1;
-	schemaf = schema;
-	thing_read = read;
-	thing_write = write;
-	configf = config;
-	eventf = event;
+	len = MIN(strlen(thing_name), sizeof(proto->device_name) - 1);
+	strncpy(proto->device_name, thing_name, len);
+	proto->enable_run = 1;
+	proto->schemaf = schema;
+	proto->thing_read = read;
+	proto->thing_write = write;
+	proto->configf = config;
+	proto->eventf = event;
+	proto->encodef = encode;
+	proto->fingerprintf = fingerprint;
+	proto->nextf = next;
+	proto->diagf = diag;
+	proto->streamf = stream;
+
+	load_identity(proto);
+
+#if KNOT_THING_LOG_SIZE > 0
+	/* Storage is shared: only things that own it may log */
+	if (!(flags & KNOT_THING_NO_STORAGE))
+		knot_thing_log_init(&proto->log);
+#endif
+
+	return 0;
 }
 
-void knot_thing_protocol_exit(void)
+void knot_thing_protocol_exit(struct knot_thing_protocol *proto)
 {
-	hal_comm_close(sock);
-	enable_run = 0;
+	if (proto->cli_sock >= 0) {
+		hal_comm_close(proto->cli_sock);
+		proto->cli_sock = -1;
+	}
+
+	hal_comm_close(proto->sock);
+	proto->enable_run = 0;
 }
 
-static int send_register(void)
+static int send_register(struct knot_thing_protocol *proto)
 {
+	knot_msg_register *msg = &proto->tx_frame.msg.reg;
 	ssize_t nbytes;
-	knot_msg_register msg;
 	int len;
 
-	memset(&msg, 0, sizeof(msg));
-	len = MIN(sizeof(msg.devName), strlen(device_name));
+	len = MIN(sizeof(msg->devName), strlen(proto->device_name));
 
-	msg.hdr.type = KNOT_MSG_REGISTER_REQ;
-	strncpy(msg.devName, device_name, len);
-	msg.hdr.payload_len = len;
+	msg->hdr.type = KNOT_MSG_REGISTER_REQ;
+	memcpy(msg->devName, proto->device_name, len);
+	msg->hdr.payload_len = len;
 
-	nbytes = hal_comm_write(cli_sock, &msg, sizeof(msg.hdr) + len);
+	nbytes = comm_write(proto, msg, sizeof(msg->hdr) + len);
 	if (nbytes < 0)
 		return -1;
 
 	return 0;
 }
 
-static int read_register(void)
+static int read_register(struct knot_thing_protocol *proto)
 {
+	knot_msg_credential *crdntl = &proto->rx_frame.cred;
 	ssize_t nbytes;
-	knot_msg_credential crdntl;
-	const uint8_t buffer[] = { 0x01 };
 
-	memset(&crdntl, 0, sizeof(crdntl));
-
-	nbytes = hal_comm_read(cli_sock, &crdntl, sizeof(crdntl));
+	nbytes = comm_read(proto, &proto->rx_frame,
+						sizeof(proto->rx_frame));
 
 	if (nbytes > 0) {
-		if (crdntl.result != KNOT_SUCCESS)
-			return -1;
+		if (crdntl->result != KNOT_SUCCESS)
+			return -EACCES;
 
-		hal_storage_write_end(HAL_STORAGE_ID_UUID, crdntl.uuid,
-						KNOT_PROTOCOL_UUID_LEN);
-		hal_storage_write_end(HAL_STORAGE_ID_TOKEN, crdntl.token,
-						KNOT_PROTOCOL_TOKEN_LEN);
+		store_credentials(proto, crdntl->uuid, crdntl->token);
 	} else if (nbytes < 0)
 		return nbytes;
 
 	return 0;
 }
 
-static int send_auth(void)
+static int send_auth(struct knot_thing_protocol *proto)
 {
-	knot_msg_authentication msg;
-	knot_msg_result resp;
+	knot_msg_auth_schema *msg = &proto->tx_frame.auth;
 	ssize_t nbytes;
 
-	memset(&msg, 0, sizeof(msg));
-
-	msg.hdr.type = KNOT_MSG_AUTH_REQ;
-	msg.hdr.payload_len = sizeof(msg.uuid) + sizeof(msg.token);
+	msg->hdr.type = KNOT_MSG_AUTH_REQ;
+	msg->hdr.payload_len = sizeof(msg->uuid) + sizeof(msg->token);
 
-	strncpy(msg.uuid, uuid, sizeof(msg.uuid));
-	strncpy(msg.token, token, sizeof(msg.token));
+	memcpy(msg->uuid, proto->uuid, sizeof(msg->uuid));
+	memcpy(msg->token, proto->token, sizeof(msg->token));
+#if KNOT_THING_SCHEMA_FINGERPRINT
+	msg->schema_fingerprint = proto->fingerprintf(proto);
+	msg->hdr.payload_len += sizeof(msg->schema_fingerprint);
+#endif
 
-	nbytes = hal_comm_write(cli_sock, &msg, sizeof(msg.hdr) +
-							msg.hdr.payload_len);
+	nbytes = comm_write(proto, msg, sizeof(msg->hdr) +
+							msg->hdr.payload_len);
 	if (nbytes < 0)
 		return -1;
 
 	return 0;
 }
 
-static int read_auth(void)
+static int read_auth(struct knot_thing_protocol *proto)
 {
-	knot_msg_result resp;
+	knot_msg_auth_result *resp = (knot_msg_auth_result *) &proto->rx_frame;
 	ssize_t nbytes;
 
-	memset(&resp, 0, sizeof(resp));
-
-	nbytes = hal_comm_read(cli_sock, &resp, sizeof(resp));
+	nbytes = comm_read(proto, &proto->rx_frame,
+						sizeof(proto->rx_frame));
 
 	if (nbytes > 0) {
-		if (resp.result != KNOT_SUCCESS)
-			return -1;
+		if (resp->result != KNOT_SUCCESS)
+			return -EACCES;
+
+		/* No fingerprint answer: keep the current schema state */
+		if (resp->hdr.payload_len < sizeof(resp->result) +
+						sizeof(resp->schema))
+			return 0;
+
+		if (resp->schema == KNOT_SCHEMA_KNOWN) {
+			proto->schema_pending = 0;
+		} else {
+			/* GW doesn't have this schema: send it all */
+			proto->schema_index = 0;
+			proto->schema_outstanding = 0;
+			proto->schema_pending = 1;
+		}
 	} else if (nbytes < 0)
 		return nbytes;
 
 	return 0;
 }
 
-static int send_schema(void)
+static int write_schema(struct knot_thing_protocol *proto,
+				knot_msg_schema *msg)
 {
-	int err;
-	knot_msg_schema msg;
 	ssize_t nbytes;
 
-	memset(&msg, 0, sizeof(msg));
-	err = schemaf(schema_sensor_id, &msg);
-
-	if (err < 0)
-		return err;
-
-	nbytes = hal_comm_write(cli_sock, &msg, sizeof(msg.hdr) +
-							msg.hdr.payload_len);
+	nbytes = comm_write(proto, msg, sizeof(msg->hdr) +
+							msg->hdr.payload_len);
 	if (nbytes < 0)
-		/* TODO create a better error define in the protocol */
-		return KNOT_ERROR_UNKNOWN;
+		return nbytes;
 
 	return KNOT_SUCCESS;
 }
 
-static int config(knot_msg_config *config)
+/*
+ * Resends the rejected items, then fills the window with new ones.
+ * Returns KNOT_SCHEMA_EMPTY only if there are no items at all, or the
+ * errno of the link. On -EAGAIN, the items not sent yet are left as they
+ * are, to be sent on the next run.
+ */
+static int send_schema(struct knot_thing_protocol *proto)
 {
+	knot_msg_schema *msg = &proto->tx_frame.msg.schema;
+	uint8_t i;
 	int err;
-	knot_msg_result resp;
+
+	for (i = 0; i < proto->schema_outstanding; i++) {
+		if (!proto->schema_window[i].resend)
+			continue;
+
+		err = proto->schemaf(proto, proto->schema_window[i].index, msg);
+		if (err != KNOT_SUCCESS)
+			return err;
+
+		err = write_schema(proto, msg);
+		if (err != KNOT_SUCCESS)
+			return err;
+
+		proto->schema_window[i].resend = 0;
+	}
+
+	while (proto->schema_outstanding < KNOT_THING_SCHEMA_WINDOW) {
+		err = proto->schemaf(proto, proto->schema_index, msg);
+		if (err == KNOT_SCHEMA_EMPTY && proto->schema_index == 0)
+			return err;
+
+		/* Every item was sent already */
+		if (err != KNOT_SUCCESS)
+			break;
+
+		/*
+		 * KNOT_MSG_SCHEMA_END closes the upload on the GW: it only
+		 * goes out once every other item is acked.
+		 */
+		if (msg->hdr.type == KNOT_MSG_SCHEMA_END &&
+						proto->schema_outstanding)
+			break;
+
+		err = write_schema(proto, msg);
+		if (err != KNOT_SUCCESS)
+			return err;
+
+		i = proto->schema_outstanding++;
+		proto->schema_window[i].index = proto->schema_index++;
+		proto->schema_window[i].sensor_id = msg->sensor_id;
+		proto->schema_window[i].resend = 0;
+	}
+
+	return KNOT_SUCCESS;
+}
+
+/* Window position of the item acked by rx_frame, or -1 */
+static int8_t schema_acked(struct knot_thing_protocol *proto)
+{
+	knot_msg_result *ack = &proto->rx_frame.action;
+	uint8_t i, sensor_id, by_id = 0;
+
+	/* The ack may carry the sensor_id right after the result */
+	if (ack->hdr.payload_len > sizeof(ack->result)) {
+		sensor_id = ((uint8_t *) ack)[sizeof(*ack)];
+		by_id = 1;
+	}
+
+	for (i = 0; i < proto->schema_outstanding; i++) {
+		if (proto->schema_window[i].resend)
+			continue;
+
+		/* Otherwise acks follow the order the items were sent */
+		if (!by_id || proto->schema_window[i].sensor_id == sensor_id)
+			return i;
+	}
+
+	return -1;
+}
+
+static void schema_window_remove(struct knot_thing_protocol *proto,
+				uint8_t pos)
+{
+	proto->schema_outstanding--;
+	/* Bounded by the window too: a window of 1 has nothing to shift */
+	for (; pos < proto->schema_outstanding &&
+			pos + 1 < KNOT_THING_SCHEMA_WINDOW; pos++)
+		proto->schema_window[pos] = proto->schema_window[pos + 1];
+}
+
+/* Connection lost: unacked items are sent again from the oldest one */
+static void schema_rewind(struct knot_thing_protocol *proto)
+{
+	if (proto->schema_outstanding == 0)
+		return;
+
+	proto->schema_index = proto->schema_window[0].index;
+	proto->schema_outstanding = 0;
+}
+
+static int config(struct knot_thing_protocol *proto,
+				knot_msg_config *config)
+{
+	knot_msg_result *resp = &proto->tx_frame.msg.action;
+	knot_config_filter *filter = NULL;
 	ssize_t nbytes;
+	int err;
 
-	err = configf(config->sensor_id, config->values.event_flags,
-						&config->values.lower_limit,
-						&config->values.upper_limit);
+	/* Event filters extension, see knot_config_filter */
+	if (config->hdr.payload_len >= sizeof(*config) - sizeof(config->hdr) +
+							sizeof(*filter))
+		filter = (knot_config_filter *) (config + 1);
 
-	memset(&resp, 0, sizeof(resp));
+	err = proto->configf(proto, config->sensor_id,
+						config->values.event_flags,
+						&config->values.lower_limit,
+						&config->values.upper_limit, filter);
 
 	/* FIXME: Create KNOT_MSG_CONFIG_RESP*/
-	resp.result = config->sensor_id;
+	resp->result = config->sensor_id;
 	if (err < 0)
-		resp.result = KNOT_ERROR_UNKNOWN;
+		resp->result = KNOT_ERROR_UNKNOWN;
 
 
-	resp.hdr.type = KNOT_MSG_CONFIG_RESP;
-	resp.hdr.payload_len = sizeof(resp.result);
+	resp->hdr.type = KNOT_MSG_CONFIG_RESP;
+	resp->hdr.payload_len = sizeof(resp->result);
 
-	nbytes = hal_comm_write(cli_sock, &resp, sizeof(resp.hdr) +
-							resp.hdr.payload_len);
+	nbytes = comm_write(proto, resp, sizeof(resp->hdr) +
+							resp->hdr.payload_len);
 	if (nbytes < 0)
 		return -1;
 
 	return 0;
 }
 
-static int set_data(knot_msg_data *data)
+static int set_data(struct knot_thing_protocol *proto,
+				knot_msg_data *data)
 {
 	int err;
 	ssize_t nbytes;
 
-	err = thing_write(data->sensor_id, data);
+	err = proto->thing_write(proto, data->sensor_id, data);
 
 	/*
 	 * GW must be aware if the data was succesfully set, so we resend
@@ -245,7 +488,7 @@ static int set_data(knot_msg_data *data)
 	if (err < 0)
 		data->hdr.type = KNOT_ERROR_UNKNOWN;
 
-	nbytes = hal_comm_write(cli_sock, data, sizeof(data->hdr) +
+	nbytes = comm_write(proto, data, sizeof(data->hdr) +
 							data->hdr.payload_len);
 	if (nbytes < 0)
 		return nbytes;
@@ -253,26 +496,33 @@ static int set_data(knot_msg_data *data)
 	return 0;
 }
 
-static int get_data(knot_msg_data *data)
+static int get_data(struct knot_thing_protocol *proto,
+				knot_msg_data *data)
 {
-	int err;
-	knot_msg_data data_resp;
+	knot_msg_data *data_resp = &proto->tx_frame.msg.data;
+	uint8_t compact[KNOT_COMPACT_MAX_LEN];
 	ssize_t nbytes;
+	int err;
 
-	memset(&data_resp, 0, sizeof(data_resp));
-	err = thing_read(data->sensor_id, &data_resp);
+	err = proto->thing_read(proto, data->sensor_id, data_resp);
 
-	data_resp.hdr.type = KNOT_MSG_DATA;
-	if (err < 0)
-		data_resp.hdr.type = KNOT_ERROR_UNKNOWN;
+	data_resp->hdr.type = KNOT_MSG_DATA;
+	if (err < 0) {
+		data_resp->hdr.type = KNOT_ERROR_UNKNOWN;
+		data_resp->hdr.payload_len = 0;
+	}
 
-	data_resp.sensor_id = data->sensor_id;
+	data_resp->sensor_id = data->sensor_id;
 
-	nbytes = hal_comm_write(cli_sock, &data_resp, sizeof(data_resp.hdr) +
-						data_resp.hdr.payload_len);
+	nbytes = comm_write(proto, data_resp,
+			sizeof(data_resp->hdr) + data_resp->hdr.payload_len);
 	if (nbytes < 0)
 		return -1;
 
+	/* The GW takes it as the reference of the next compact readings */
+	if (err == 0 && proto->encoding != KNOT_ENCODING_FULL)
+		proto->encodef(proto, data_resp, compact, sizeof(compact));
+
 	return 0;
 }
 
@@ -281,50 +531,475 @@ static int data_resp(knot_msg_result *action)
 	return action->result;
 }
 
-static int send_data(knot_msg_data *msg_data)
+#if KNOT_THING_BATCH_MTU > 0
+static int batch_flush(struct knot_thing_protocol *proto)
 {
+	knot_msg_header *hdr = (knot_msg_header *) proto->batch;
+	ssize_t nbytes;
+
+	if (proto->batch_len <= BATCH_HDR_LEN)
+		return 0;
+
+	hdr->type = KNOT_MSG_DATA_BATCH;
+	hdr->payload_len = proto->batch_len - BATCH_HDR_LEN;
+
+	/* Kept on failure: sent again by the next flush */
+	nbytes = comm_write(proto, proto->batch,
+							proto->batch_len);
+	if (nbytes < 0)
+		return nbytes;
+
+	proto->batch_len = BATCH_HDR_LEN;
+
+	return 0;
+}
+
+/*
+ * Appends a reading to the pending batch. The batch is sent when the
+ * next reading would not fit, when it can't take even a one byte value
+ * anymore or, from the main loop, when it gets older than
+ * KNOT_THING_BATCH_AGE_MS.
+ */
+static int batch_add(struct knot_thing_protocol *proto,
+				knot_msg_data *msg_data)
+{
+	uint8_t value_len = msg_data->hdr.payload_len -
+						sizeof(msg_data->sensor_id);
+	uint8_t *record;
 	int err;
 
-	err = hal_comm_write(cli_sock, msg_data,
+	if (proto->batch_len + BATCH_RECORD_HDR_LEN + value_len >
+						sizeof(proto->batch)) {
+		err = batch_flush(proto);
+		if (err < 0)
+			return err;
+	}
+
+	if (proto->batch_len <= BATCH_HDR_LEN) {
+		proto->batch_len = BATCH_HDR_LEN;
+		proto->batch_start = hal_time_ms();
+	}
+
+	record = proto->batch + proto->batch_len;
+	record[0] = msg_data->sensor_id;
+	record[1] = value_len;
+	memcpy(record + BATCH_RECORD_HDR_LEN, &msg_data->payload, value_len);
+	proto->batch_len += BATCH_RECORD_HDR_LEN + value_len;
+
+	if (proto->batch_len + BATCH_RECORD_HDR_LEN + 1 >
+						sizeof(proto->batch)) {
+		err = batch_flush(proto);
+		/* The reading is in the batch already: retried from there */
+		if (err < 0 && err != -EAGAIN)
+			return err;
+	}
+
+	return 0;
+}
+
+static int batch_expire(struct knot_thing_protocol *proto)
+{
+	if (proto->batch_len <= BATCH_HDR_LEN)
+		return 0;
+
+	if (hal_time_ms() - proto->batch_start < KNOT_THING_BATCH_AGE_MS)
+		return 0;
+
+	return batch_flush(proto);
+}
+#endif
+
+static int get_diag(struct knot_thing_protocol *proto, knot_msg_get_diag *req)
+{
+	knot_msg_diag_item *item = &proto->tx_frame.diag_item;
+	knot_msg_diag *diag = &proto->tx_frame.diag;
+	ssize_t nbytes;
+
+	if (req->hdr.payload_len < sizeof(req->sensor_id)) {
+		diag->hdr.type = KNOT_MSG_DIAG_RESP;
+		diag->hdr.payload_len = sizeof(diag->stats);
+		diag->stats = proto->stats;
+		diag->stats.state = proto->state;
+
+		nbytes = comm_write(proto, diag, sizeof(*diag));
+		return (nbytes < 0 ? -1 : 0);
+	}
+
+	item->hdr.type = KNOT_MSG_DIAG_ITEM_RESP;
+	item->hdr.payload_len = sizeof(*item) - sizeof(item->hdr);
+	item->sensor_id = req->sensor_id;
+	item->result = KNOT_SUCCESS;
+	if (proto->diagf(proto, req->sensor_id, &item->stats) < 0) {
+		memset(&item->stats, 0, sizeof(item->stats));
+		item->result = KNOT_INVALID_DATA;
+	}
+
+	nbytes = comm_write(proto, item, sizeof(*item));
+
+	return (nbytes < 0 ? -1 : 0);
+}
+
+static int set_encoding(struct knot_thing_protocol *proto,
+				knot_msg_encoding *msg)
+{
+	knot_msg_result *resp = &proto->tx_frame.msg.action;
+	ssize_t nbytes;
+
+	resp->result = KNOT_SUCCESS;
+	if (msg->encoding & ~ENCODINGS)
+		resp->result = KNOT_INVALID_DATA;
+	else {
+		proto->encoding = msg->encoding;
+		/* Gateway has no reference values yet */
+		if (proto->encoding != KNOT_ENCODING_FULL)
+			proto->encodef(proto, NULL, NULL, 0);
+	}
+
+	resp->hdr.type = KNOT_MSG_ENCODING_RESP;
+	resp->hdr.payload_len = sizeof(resp->result);
+
+	nbytes = comm_write(proto, resp, sizeof(resp->hdr) +
+						resp->hdr.payload_len);
+	if (nbytes < 0)
+		return -1;
+
+	return 0;
+}
+
+static int send_data(struct knot_thing_protocol *proto,
+				knot_msg_data *msg_data)
+{
+	uint8_t frame[sizeof(knot_msg_header) + 1 + KNOT_COMPACT_MAX_LEN];
+	knot_msg_header *hdr = (knot_msg_header *) frame;
+	int err, len;
+
+#if KNOT_THING_BATCH_MTU > 0
+	if (msg_data->hdr.type == KNOT_MSG_DATA)
+		return batch_add(proto, msg_data);
+#endif
+
+	if (proto->encoding != KNOT_ENCODING_FULL &&
+				msg_data->hdr.type == KNOT_MSG_DATA) {
+		len = proto->encodef(proto, msg_data, frame + sizeof(*hdr) + 1,
+						KNOT_COMPACT_MAX_LEN);
+		if (len > 0) {
+			hdr->type = KNOT_MSG_DATA_COMPACT;
+			hdr->payload_len = len + 1;
+			frame[sizeof(*hdr)] = msg_data->sensor_id;
+
+			err = comm_write(proto, frame,
+						sizeof(*hdr) + hdr->payload_len);
+			if (err < 0) {
+				/* Gateway missed this delta: resync in full */
+				proto->encodef(proto, NULL, NULL, 0);
+				return err;
+			}
+
+			return 0;
+		}
+	}
+
+	err = comm_write(proto, msg_data,
 			sizeof(msg_data->hdr) + msg_data->hdr.payload_len);
-	if (err < 0)
+	if (err < 0) {
+		/* Already the reference: the next ones must not be deltas */
+		if (proto->encoding != KNOT_ENCODING_FULL)
+			proto->encodef(proto, NULL, NULL, 0);
 		return err;
+	}
 
 	return 0;
 }
 
-static inline int is_uuid(const char *string)
+static inline knot_msg_data *txq_tail(struct knot_thing_protocol *proto)
 {
-	return (strlen(string) == 36 && string[8] == '-' &&
-		string[13] == '-' && string[18] == '-' && string[23] == '-');
+	return &proto->txq[(proto->txq_head + proto->txq_len) %
+							KNOT_THING_TXQ_LEN];
 }
 
-int knot_thing_protocol_run(void)
+/* Queues the reading built at the tail slot */
+static void txq_commit(struct knot_thing_protocol *proto)
+{
+	knot_msg_data *tail = txq_tail(proto);
+	knot_msg_data *pending;
+	uint8_t i;
+
+	proto->stats.readings++;
+
+	for (i = 0; i < proto->txq_len; i++) {
+		pending = &proto->txq[(proto->txq_head + i) %
+							KNOT_THING_TXQ_LEN];
+		if (pending->sensor_id != tail->sensor_id ||
+				pending->hdr.type != tail->hdr.type)
+			continue;
+
+		/* Coalesce: newest value, oldest position in the queue */
+		memcpy(pending, tail, sizeof(tail->hdr) +
+						tail->hdr.payload_len);
+		proto->stats.coalesced++;
+		return;
+	}
+
+	proto->txq_len++;
+}
+
+/*
+ * Sends the queued readings in order. Stops at the first failure, which
+ * leaves that reading at the head to be retried on the next run.
+ */
+static int txq_flush(struct knot_thing_protocol *proto)
 {
-	static uint8_t state = STATE_DISCONNECTED;
-	static uint8_t previous_state = STATE_DISCONNECTED;
+	int err;
+
+	while (proto->txq_len > 0) {
+		err = send_data(proto, &proto->txq[proto->txq_head]);
+		if (err < 0)
+			return err;
+
+		proto->txq_head = (proto->txq_head + 1) % KNOT_THING_TXQ_LEN;
+		proto->txq_len--;
+	}
+
+	return 0;
+}
+
+#if KNOT_THING_LOG_SIZE > 0
+/*
+ * Offline, readings with an event are logged instead. They are built in
+ * tx_frame: the queue may be full with readings waiting for the link.
+ */
+static void log_events(struct knot_thing_protocol *proto)
+{
+	knot_msg_data *data = &proto->tx_frame.msg.data;
+	uint8_t count;
+
+	if (proto->flags & KNOT_THING_NO_STORAGE)
+		return;
+
+	for (count = 0; count < KNOT_THING_DATA_MAX; count++) {
+		if (proto->eventf(proto, data) != 0)
+			break;
+
+		KNOT_TRACE_BEGIN(KNOT_TRACE_ID_LOG, data->sensor_id);
+		knot_thing_log_append(&proto->log, data);
+		KNOT_TRACE_END(KNOT_TRACE_ID_LOG, data->sensor_id);
+	}
+}
+
+/*
+ * Uploads the oldest logged reading, at most one every
+ * KNOT_THING_LOG_UPLOAD_MS and only once the live readings are out. The
+ * queue is empty then, so its tail slot is free to read the log into.
+ */
+static int log_upload(struct knot_thing_protocol *proto)
+{
+	knot_msg_data_log *msg = &proto->tx_frame.data_log;
+	knot_msg_data *data = txq_tail(proto);
+	uint8_t len;
+	uint32_t age;
+	ssize_t nbytes;
+	int err;
+
+	if (proto->log.count == 0 ||
+		(int32_t) (hal_time_ms() - proto->log_upload_at) < 0)
+		return 0;
+
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_LOG, 0);
+	err = knot_thing_log_peek(&proto->log, data, &age);
+	KNOT_TRACE_END(KNOT_TRACE_ID_LOG, proto->log.count);
+	if (err < 0)
+		return 0;
+
+	len = data->hdr.payload_len - sizeof(data->sensor_id);
+	msg->hdr.type = KNOT_MSG_DATA_LOG;
+	msg->hdr.payload_len = sizeof(msg->age) + sizeof(msg->type) +
+					sizeof(msg->sensor_id) + len;
+	msg->age = age;
+	msg->type = data->hdr.type;
+	msg->sensor_id = data->sensor_id;
+	memcpy(&msg->payload, &data->payload, len);
+
+	/* Kept in the log on failure */
+	nbytes = comm_write(proto, msg,
+				sizeof(msg->hdr) + msg->hdr.payload_len);
+	if (nbytes < 0)
+		return nbytes;
+
+	knot_thing_log_pop(&proto->log);
+	proto->log_upload_at = hal_time_ms() + KNOT_THING_LOG_UPLOAD_MS;
+
+	return 0;
+}
+#endif
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+/*
+ * Sends the next fragment of the blob being streamed, one per run and
+ * only once the live readings are out, like the log
+ */
+static int stream_send(struct knot_thing_protocol *proto)
+{
+	knot_msg_data_stream *msg = &proto->tx_frame.stream;
+	ssize_t nbytes;
+
+	proto->streaming = 0;
+	if (proto->streamf == NULL || proto->streamf(proto, msg) < 0)
+		return 0;
+
+	proto->streaming = 1;
+
+	/* Built again on failure */
+	nbytes = comm_write(proto, msg,
+				sizeof(msg->hdr) + msg->hdr.payload_len);
+	if (nbytes < 0)
+		return nbytes;
+
+	proto->streamf(proto, NULL);
+
+	return 0;
+}
+#endif
+
+/*
+ * Delay before the next recovery attempt: exponential on the number of
+ * consecutive failures, with equal jitter (half fixed, half random) so a
+ * fleet of things losing the same gateway don't retry in lockstep.
+ */
+static uint32_t retry_delay(uint8_t retries)
+{
+	uint32_t delay = KNOT_THING_RETRY_MIN_MS;
+	uint16_t jitter = 0;
+
+	while (retries-- > 0 && delay < KNOT_THING_RETRY_MAX_MS)
+		delay <<= 1;
+
+	delay = MIN(delay, KNOT_THING_RETRY_MAX_MS);
+	hal_getrandom(&jitter, sizeof(jitter));
+
+	return delay / 2 + jitter % (delay / 2 + 1);
+}
+
+/* Doubles from KNOT_THING_TX_RETRY_MS on every busy run */
+static uint32_t tx_retry_delay(uint8_t busy)
+{
+	uint32_t delay = KNOT_THING_TX_RETRY_MS;
+
+	while (--busy > 0 && delay < KNOT_THING_IDLE_MAX_MS)
+		delay <<= 1;
+
+	return MIN(delay, KNOT_THING_IDLE_MAX_MS);
+}
+
+/* Time (ms) until 'at', 0 if it is past already */
+static uint32_t time_until(uint32_t at)
+{
+	int32_t delay = (int32_t) (at - hal_time_ms());
+
+	return (delay > 0 ? delay : 0);
+}
+
+/*
+ * Time until the next protocol step has work to do: sending, a backoff
+ * to expire, a reading to sample, batch or upload. While a frame from
+ * the GW may come, run must be called again within KNOT_THING_IDLE_MAX_MS,
+ * as frames are only read there.
+ */
+static uint32_t next_delay(struct knot_thing_protocol *proto)
+{
+	uint32_t delay = KNOT_THING_IDLE_MAX_MS;
+	uint8_t sampling = (proto->state == STATE_ONLINE);
+	int32_t next;
+
+	switch (proto->state) {
+	case STATE_DISCONNECTED:
+		return 0;
+	case STATE_SCHEMA:
+		/* Link busy: the window is refilled after a backoff */
+		if (proto->tx_busy)
+			return tx_retry_delay(proto->tx_busy);
+
+		return 0;
+	case STATE_ERROR:
+		if (!proto->backoff)
+			return 0;
+
+		/* Not connected: nothing to read until the retry */
+		delay = time_until(proto->retry_at);
+		break;
+	case STATE_ONLINE:
+		/*
+		 * Link busy: readings and fragments are kept, retried after
+		 * a backoff instead of spinning on the radio
+		 */
+		if (proto->tx_busy)
+			return tx_retry_delay(proto->tx_busy);
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+		/* Next fragment */
+		if (proto->streaming)
+			return 0;
+#endif
+
+#if KNOT_THING_BATCH_MTU > 0
+		if (proto->batch_len > BATCH_HDR_LEN)
+			delay = MIN(delay, time_until(proto->batch_start +
+						KNOT_THING_BATCH_AGE_MS));
+#endif
+#if KNOT_THING_LOG_SIZE > 0
+		if (proto->log.count > 0)
+			delay = MIN(delay, time_until(proto->log_upload_at));
+#endif
+		break;
+	}
+
+#if KNOT_THING_LOG_SIZE > 0
+	/* Offline, readings are still sampled to be logged */
+	if (!(proto->flags & KNOT_THING_NO_STORAGE))
+		sampling = 1;
+#endif
+
+	if (sampling) {
+		next = proto->nextf(proto);
+		if (next >= 0)
+			delay = MIN(delay, (uint32_t) next);
+	}
+
+	return delay;
+}
+
+int knot_thing_protocol_run(struct knot_thing_protocol *proto)
+{
+	knot_msg *rx = &proto->rx_frame;
 	int retval = 0;
+	uint8_t count, acked, rejected, state;
+	int8_t pos;
 	ssize_t ilen;
-	knot_msg kreq;
-	knot_msg_data msg_data;
 	struct nrf24_mac addr;
 
-	memset(&msg_data, 0, sizeof(msg_data));
+	if (proto->enable_run == 0)
+		return -1;
 
-	/* Set mac address */
-	set_nrf24MAC(&addr);
+	state = proto->state;
+	KNOT_TRACE_BEGIN(KNOT_TRACE_ID_RUN, state);
 
-	if (enable_run == 0)
-		return -1;
+#if KNOT_THING_LOG_SIZE > 0
+	if (proto->state != STATE_ONLINE)
+		log_events(proto);
+#endif
 
 	/* Network message handling state machine */
-	switch (state) {
+	switch (proto->state) {
 	case STATE_DISCONNECTED:
 		/* Internally listen starts broadcasting presence*/
-		if (hal_comm_listen(sock) < 0)
-			state = STATE_ERROR;
+		retval = hal_comm_listen(proto->sock);
+		if (retval < 0) {
+			proto->last_error = retval;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
+			break;
+		}
 
-		state = STATE_CONNECTING;
+		proto->state = STATE_CONNECTING;
 		break;
 
 	case STATE_CONNECTING:
@@ -332,130 +1007,196 @@ int knot_thing_protocol_run(void)
 		 * Try to accept GW connection request. EAGAIN means keep
 		 * waiting, less then 0 means error and greater then 0 success
 		 */
-		cli_sock = hal_comm_accept(sock, &(addr.address.uint64));
-		if (cli_sock == -EAGAIN)
+		addr = proto->mac;
+		KNOT_TRACE_BEGIN(KNOT_TRACE_ID_ACCEPT, 0);
+		proto->cli_sock = hal_comm_accept(proto->sock,
+						&(addr.address.uint64));
+		KNOT_TRACE_END(KNOT_TRACE_ID_ACCEPT, 0);
+		if (proto->cli_sock == -EAGAIN)
 			break;
-		else if (cli_sock < 0) {
-			state = STATE_ERROR;
+		else if (proto->cli_sock < 0) {
+			proto->last_error = proto->cli_sock;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
 			break;
 		}
+
+		proto->stats.connects++;
+
+		/* Encoding is negotiated again on every connection */
+		proto->encoding = KNOT_ENCODING_FULL;
+		proto->tx_busy = 0;
+
+#if KNOT_THING_BATCH_MTU > 0
+		/* Readings batched for a previous connection are stale */
+		proto->batch_len = BATCH_HDR_LEN;
+#endif
 		/*
-		 * If uuid/token were found, read the addresses and send
-		 * the auth request, otherwise register request
+		 * If uuid/token were found (cached at init), send the auth
+		 * request, otherwise register request
 		 */
-		hal_storage_read_end(HAL_STORAGE_ID_UUID, uuid,
-					KNOT_PROTOCOL_UUID_LEN);
-		hal_storage_read_end(HAL_STORAGE_ID_TOKEN, token,
-				KNOT_PROTOCOL_TOKEN_LEN);
-
-		if (!is_uuid(uuid)) {
-			state = STATE_AUTHENTICATING;
-			if (send_auth() < 0) {
-				previous_state = state;
-				state = STATE_ERROR;
-			}
+		if (is_uuid(proto->uuid)) {
+			proto->state = STATE_AUTHENTICATING;
+			retval = send_auth(proto);
 		} else {
-			state = STATE_REGISTERING;
-			if (send_register() < 0) {
-				previous_state = state;
-				state = STATE_ERROR;
-			}
+			proto->state = STATE_REGISTERING;
+			retval = send_register(proto);
+		}
+
+		if (retval < 0) {
+			proto->last_error = retval;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
 		}
 		break;
 	/*
 	 * Authenticating, Resgistering cases waits (without blocking)
 	 * for an response of the respective requests, -EAGAIN means there was
-	 * nothing to read so we ignore it, less then 0 an error and 0 success
+	 * nothing to read so we ignore it, -EACCES a request rejected by the
+	 * GW, less then 0 an error and 0 success
 	 */
 	case STATE_AUTHENTICATING:
-		retval = read_auth();
+		retval = read_auth(proto);
 		if (!retval)
-			state = STATE_ONLINE;
+			/* Resume a schema interrupted by a connection loss */
+			proto->state = (proto->schema_pending ? STATE_SCHEMA :
+								STATE_ONLINE);
 		else if (retval != -EAGAIN) {
-			previous_state = state;
-			state = STATE_ERROR;
+			proto->last_error = retval;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
 		}
 		break;
 
 	case STATE_REGISTERING:
-		retval = read_register();
-		if (!retval)
-			state = STATE_SCHEMA;
-		else if (retval != -EAGAIN) {
-			previous_state = state;
-			state = STATE_ERROR;
+		retval = read_register(proto);
+		if (!retval) {
+			proto->state = STATE_SCHEMA;
+			proto->schema_index = 0;
+			proto->schema_outstanding = 0;
+			proto->schema_pending = 1;
+		} else if (retval != -EAGAIN) {
+			proto->last_error = retval;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
 		}
 		break;
 	/*
-	 * STATE_SCHEMA tries to send an schema and go to STATE_SCHEMA_RESP to
-	 * wait for the ack of this schema. If there is no schema for that
-	 * schema_sensor_id, increments and stays in the STATE_SCHEMA. If an
+	 * STATE_SCHEMA sends schemas without waiting for acks, up to
+	 * KNOT_THING_SCHEMA_WINDOW outstanding ones, and goes to
+	 * STATE_SCHEMA_RESP to wait for the acks. KNOT_SCHEMA_EMPTY means
+	 * there are no items at all, so there is nothing to send. If the
+	 * link is busy, stays to send the rest after a backoff. If another
 	 * error occurs, goes to STATE_ERROR.
 	 */
 	case STATE_SCHEMA:
-		retval = send_schema();
+		retval = send_schema(proto);
+		if (retval != -EAGAIN)
+			proto->tx_busy = 0;
+		else if (proto->tx_busy < UINT8_MAX)
+			proto->tx_busy++;
+
 		switch (retval) {
 		case KNOT_SUCCESS:
-			state = STATE_SCHEMA_RESP;
+			proto->state = STATE_SCHEMA_RESP;
 			break;
-		case KNOT_ERROR_UNKNOWN:
-			previous_state = state;
-			state = STATE_ERROR;
+		case -EAGAIN:
+			/* Link busy: send the rest of the window on next run */
 			break;
 		case KNOT_SCHEMA_EMPTY:
-			state = STATE_SCHEMA;
-			schema_sensor_id++;
+			proto->state = STATE_ONLINE;
+			proto->schema_index = 0;
+			proto->schema_pending = 0;
 			break;
 		default:
 			/* TODO: invalid command */
+			if (retval > 0)
+				break;
+
+			proto->last_error = retval;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
 			break;
 		}
 		break;
 	/*
-	 * Receives the ack from the GW and returns to STATE_SCHEMA to send the
-	 * next schema. If it was the ack for the last schema, goes to
-	 * STATE_ONLINE. If it is not a KNOT_MSG_SCHEMA_RESP, ignores. If the
-	 * result was not KNOT_SUCCESS, goes to STATE_ERROR.
+	 * Receives every ack available from the GW and returns to
+	 * STATE_SCHEMA to refill the window. If it was the ack for the last
+	 * schema, goes to STATE_ONLINE. If it is not a KNOT_MSG_SCHEMA_RESP,
+	 * ignores. Items whose result was not KNOT_SUCCESS are flagged to be
+	 * sent again and go to STATE_ERROR.
 	 */
 	case STATE_SCHEMA_RESP:
-		ilen = hal_comm_read(cli_sock, &kreq, sizeof(kreq));
-		if (ilen > 0) {
-			if (kreq.hdr.type != KNOT_MSG_SCHEMA_RESP &&
-				kreq.hdr.type != KNOT_MSG_SCHEMA_END_RESP)
-				break;
-			if (kreq.action.result != KNOT_SUCCESS) {
-				previous_state = state;
-				state = STATE_ERROR;
-				break;
+		acked = 0;
+		rejected = 0;
+		while ((ilen = comm_read(proto, rx,
+						sizeof(*rx))) > 0) {
+			if (rx->hdr.type != KNOT_MSG_SCHEMA_RESP &&
+				rx->hdr.type != KNOT_MSG_SCHEMA_END_RESP)
+				continue;
+
+			pos = schema_acked(proto);
+			if (pos < 0)
+				continue;
+
+			if (rx->action.result != KNOT_SUCCESS) {
+				proto->schema_window[pos].resend = 1;
+				rejected = 1;
+				continue;
 			}
-			if (kreq.hdr.type != KNOT_MSG_SCHEMA_END_RESP) {
-				state = STATE_SCHEMA;
-				schema_sensor_id++;
+
+			schema_window_remove(proto, pos);
+			acked = 1;
+
+			if (rx->hdr.type == KNOT_MSG_SCHEMA_END_RESP) {
+				proto->state = STATE_ONLINE;
+				proto->schema_index = 0;
+				proto->schema_pending = 0;
 				break;
 			}
-			state = STATE_ONLINE;
-			schema_sensor_id = 0;
+		}
+
+		if (rejected) {
+			proto->last_error = -EACCES;
+			proto->previous_state = STATE_SCHEMA_RESP;
+			proto->state = STATE_ERROR;
+		} else if (acked && proto->state == STATE_SCHEMA_RESP)
+			proto->state = STATE_SCHEMA;
+		else if (ilen < 0 && ilen != -EAGAIN) {
+			proto->last_error = ilen;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
 		}
 	break;
 
 	case STATE_ONLINE:
-		ilen = hal_comm_read(cli_sock, &kreq, sizeof(kreq));
+		/* Online again: next failure starts from the shortest delay */
+		proto->retries = 0;
+
+		ilen = comm_read(proto, rx, sizeof(*rx));
 		if (ilen > 0) {
 			/* There is config or set data */
-			switch (kreq.hdr.type) {
+			switch (rx->hdr.type) {
 			case KNOT_MSG_SET_CONFIG:
-				config(&kreq.config);
+				config(proto, &rx->config);
 				break;
 			case KNOT_MSG_SET_DATA:
-				set_data(&kreq.data);
+				set_data(proto, &rx->data);
 				break;
 			case KNOT_MSG_GET_DATA:
-				get_data(&kreq.data);
+				get_data(proto, &rx->data);
+				break;
+			case KNOT_MSG_SET_ENCODING:
+				set_encoding(proto, (knot_msg_encoding *) rx);
+				break;
+			case KNOT_MSG_GET_DIAG:
+				get_diag(proto, (knot_msg_get_diag *) rx);
 				break;
 			case KNOT_MSG_DATA_RESP:
-				if (data_resp(&kreq.action)) {
-					previous_state = state;
-					state = STATE_ERROR;
+				if (data_resp(&rx->action)) {
+					proto->last_error = -EACCES;
+					proto->previous_state = proto->state;
+					proto->state = STATE_ERROR;
 				}
 				break;
 			default:
@@ -463,40 +1204,129 @@ int knot_thing_protocol_run(void)
 				break;
 			}
 		}
-		/* If some event ocurred send msg_data */
-		if (eventf(&msg_data) == 0)
-			if (send_data(&msg_data) < 0)
-				state = STATE_ERROR;
+
+		if (proto->state != STATE_ONLINE)
+			break;
+
+		/*
+		 * Queue a msg_data for each item with an event: bounded so
+		 * items sampled too often can't starve the radio. Backpressure:
+		 * while the queue is full, events are not sampled at all and
+		 * stay due until the link drains it.
+		 */
+		for (count = 0; count < KNOT_THING_DATA_MAX &&
+				proto->txq_len < KNOT_THING_TXQ_LEN; count++) {
+			if (proto->eventf(proto, txq_tail(proto)) != 0)
+				break;
+
+			txq_commit(proto);
+		}
+
+		/* -EAGAIN: link busy, keep the readings and retry later */
+		retval = txq_flush(proto);
+#if KNOT_THING_BATCH_MTU > 0
+		if (retval == 0)
+			retval = batch_expire(proto);
+#endif
+#if KNOT_THING_LOG_SIZE > 0
+		if (retval == 0)
+			retval = log_upload(proto);
+#endif
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+		if (retval == 0)
+			retval = stream_send(proto);
+#endif
+		if (retval != -EAGAIN)
+			proto->tx_busy = 0;
+		else if (proto->tx_busy < UINT8_MAX)
+			proto->tx_busy++;
+
+		if (retval < 0 && retval != -EAGAIN) {
+			proto->last_error = retval;
+			proto->previous_state = proto->state;
+			proto->state = STATE_ERROR;
+		}
 
 	break;
 
+	/*
+	 * Waits (without blocking) for the backoff delay, then recovers
+	 * according to the state that failed. A request rejected by the GW
+	 * (-EACCES) is retried on the same connection; any other error means
+	 * the link is gone, so the connection is closed and set up again.
+	 * The cached credentials take it straight to authentication and an
+	 * interrupted schema is resumed from the oldest unacked item.
+	 */
 	case STATE_ERROR:
-		//TODO: log error
-		//TODO: close connection if needed
-		//TODO: wait 1s
-		switch (previous_state) {
-		case STATE_CONNECTING:
-			break;
-		case STATE_AUTHENTICATING:
+		if (!proto->backoff) {
+			proto->stats.errors++;
+			proto->stats.last_error = proto->last_error;
+			if (proto->last_error == -EACCES)
+				proto->stats.rejects++;
+
+			proto->retry_at = hal_time_ms() +
+						retry_delay(proto->retries);
+			if (proto->retries < UINT8_MAX)
+				proto->retries++;
+			proto->backoff = 1;
 			break;
-		case STATE_REGISTERING:
-			break;
-		case STATE_SCHEMA:
-			break;
-		case STATE_SCHEMA_RESP:
+		}
+
+		if ((int32_t) (hal_time_ms() - proto->retry_at) < 0)
 			break;
-		case STATE_ONLINE:
+
+		proto->backoff = 0;
+		proto->state = STATE_DISCONNECTED;
+
+		if (proto->last_error == -EACCES) {
+			switch (proto->previous_state) {
+			case STATE_AUTHENTICATING:
+				/* Credentials not valid anymore: register */
+				memset(proto->uuid, 0, sizeof(proto->uuid));
+				/* Fall through */
+			case STATE_REGISTERING:
+				proto->state = STATE_REGISTERING;
+				retval = send_register(proto);
+				break;
+			case STATE_SCHEMA_RESP:
+				/* Send only the rejected schema items again */
+				proto->state = STATE_SCHEMA;
+				break;
+			case STATE_ONLINE:
+				proto->state = STATE_ONLINE;
+				break;
+			}
+
+			if (retval < 0) {
+				proto->last_error = retval;
+				proto->previous_state = proto->state;
+				proto->state = STATE_ERROR;
+			}
+		}
+
+		if (proto->state != STATE_DISCONNECTED)
 			break;
+
+		schema_rewind(proto);
+		if (proto->cli_sock >= 0) {
+			hal_comm_close(proto->cli_sock);
+			proto->cli_sock = -1;
 		}
-		state = STATE_DISCONNECTED;
 	break;
 
 	default:
 		//TODO: log invalid state
 		//TODO: close connection if needed
-		state = STATE_DISCONNECTED;
+		proto->state = STATE_DISCONNECTED;
 	break;
 	}
 
-	return 0;
+	if (proto->state != state) {
+		proto->stats.state_changes++;
+		KNOT_TRACE_INSTANT(KNOT_TRACE_ID_STATE, proto->state);
+	}
+
+	KNOT_TRACE_END(KNOT_TRACE_ID_RUN, proto->state);
+
+	return next_delay(proto);
 }
@@ -15,18 +15,444 @@ extern "C" {
 #endif
 
 #include "knot_protocol.h"
+#include "knot_thing_config.h"
+#include "include/nrf24.h"
+#include "knot_thing_log.h"
 
-typedef int (*data_function)(uint8_t sensor_id, knot_msg_data *data);
-typedef int (*schema_function)(uint8_t sensor_id, knot_msg_schema *schema);
-typedef int (*config_function)(uint8_t sensor_id, uint8_t event_flags,
-		knot_value_types *lower_limit, knot_value_types *upper_limit);
-typedef int (*events_function)(knot_msg_data *data);
-
-int knot_thing_protocol_init(const char *thing_name, data_function read,
-				data_function write, schema_function schema,
-				config_function config, events_function event);
-void knot_thing_protocol_exit(void);
-int knot_thing_protocol_run(void);
+/*
+ * Thing side protocol extensions. Only sent to gateways that support
+ * them: see knot_thing_config.h to enable each one.
+ */
+
+/*
+ * Several readings packed in one frame. The payload is a sequence of
+ * records: sensor_id (1 byte), value length (1 byte) and the value, in
+ * the same format as knot_msg_data payload.
+ */
+#ifndef KNOT_MSG_DATA_BATCH
+#define KNOT_MSG_DATA_BATCH		0x60
+#endif
+
+/*
+ * Data encoding negotiation: the gateway sends KNOT_MSG_SET_ENCODING and
+ * the thing answers KNOT_MSG_ENCODING_RESP. With the compact encoding
+ * int and float readings go out as KNOT_MSG_DATA_COMPACT: sensor_id,
+ * a flags byte and zigzag varint deltas against the previous value sent
+ * for the same item (value, then value_dec if KNOT_COMPACT_FLAG_DEC),
+ * followed by the absolute multiplier if KNOT_COMPACT_FLAG_MULTIPLIER.
+ * The first reading of each item after (re)negotiation or reconnection
+ * is always sent as a full KNOT_MSG_DATA. Replies to KNOT_MSG_GET_DATA
+ * are full too, and the next deltas are against them.
+ *
+ * KNOT_ENCODING_RAW_DELTA, alone or or'ed with KNOT_ENCODING_COMPACT,
+ * sends raw readings of items registered with a raw_buffer as
+ * KNOT_MSG_DATA_COMPACT too: sensor_id, a flags byte (0) and the byte
+ * ranges that changed since the previous value sent, each one as offset
+ * (1 byte), length (1 byte) and the new bytes. Ranges closer than 3 bytes
+ * are merged. Readings whose delta would not be shorter, and one every
+ * KNOT_THING_RAW_REFRESH, are sent in full.
+ *
+ * Things built without KNOT_THING_COMPACT_ENCODING, and things that batch
+ * readings (KNOT_THING_BATCH_MTU), only send full ones: they answer
+ * KNOT_INVALID_DATA to any other encoding.
+ */
+#ifndef KNOT_MSG_SET_ENCODING
+#define KNOT_MSG_SET_ENCODING		0x61
+#endif
+#ifndef KNOT_MSG_ENCODING_RESP
+#define KNOT_MSG_ENCODING_RESP		0x62
+#endif
+#ifndef KNOT_MSG_DATA_COMPACT
+#define KNOT_MSG_DATA_COMPACT		0x63
+#endif
+
+#define KNOT_ENCODING_FULL		0x00
+#define KNOT_ENCODING_COMPACT		0x01
+#define KNOT_ENCODING_RAW_DELTA		0x02
+
+#define KNOT_COMPACT_FLAG_MULTIPLIER	0x01
+#define KNOT_COMPACT_FLAG_DEC		0x02
+
+/* flags byte plus up to three 5 bytes varints, or a shorter raw value */
+#define KNOT_COMPACT_MAX_LEN		(KNOT_DATA_RAW_SIZE > 16 ? \
+						KNOT_DATA_RAW_SIZE : 16)
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header		hdr;
+	uint8_t			encoding;
+} knot_msg_encoding;
+
+/*
+ * Schema fingerprint: KNOT_MSG_AUTH_REQ carries, after the token, a 32
+ * bits FNV-1a hash of the registered schema. It covers, for each item in
+ * sensor_id order, the sensor_id, type_id (little endian), value_type,
+ * unit and the name up to its NUL (at most KNOT_PROTOCOL_DATA_NAME_LEN
+ * bytes, as in the schema frame). A GW that already has this schema for
+ * the thing answers with KNOT_SCHEMA_KNOWN after the result and the thing
+ * goes online at once, KNOT_SCHEMA_UNKNOWN makes it upload the schema
+ * again. Plain answers keep the schema assumed known. Only sent with
+ * KNOT_THING_SCHEMA_FINGERPRINT: otherwise the request is a plain
+ * knot_msg_authentication.
+ */
+#define KNOT_SCHEMA_UNKNOWN		0x00
+#define KNOT_SCHEMA_KNOWN		0x01
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header		hdr;
+	char			uuid[KNOT_PROTOCOL_UUID_LEN];
+	char			token[KNOT_PROTOCOL_TOKEN_LEN];
+	uint32_t		schema_fingerprint;
+} knot_msg_auth_schema;
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header		hdr;
+	int8_t			result;
+	uint8_t			schema;		// KNOT_SCHEMA_*
+} knot_msg_auth_result;
+
+/*
+ * Event filters: a KNOT_MSG_SET_CONFIG whose payload is longer than the
+ * knot_msg_config one carries a knot_config_filter right after it. Plain
+ * ones leave the filters of the item as they were. Deadband and
+ * hysteresis are values of the item type (int or float), as the limits.
+ * A change event needs the value to move away from the last one reported
+ * by more than the deadband and by more than deadband_rel thousandths of
+ * it. With a hysteresis a threshold event is reported once, when the
+ * limit is crossed, and again only after the value came back by more
+ * than the hysteresis; without one every sample beyond a limit is
+ * reported. Nothing is reported sooner than min_interval ms after the
+ * previous report of the item. Zero disables each filter.
+ */
+typedef struct __attribute__ ((packed)) {
+	knot_value_types	deadband;
+	uint16_t		deadband_rel;	// 1/1000 of the last value
+	knot_value_types	hysteresis;
+	uint32_t		min_interval;	// ms
+} knot_config_filter;
+
+/*
+ * Windowed aggregates: an item set to aggregate (see
+ * knot_thing_config_data_item_aggregate()) is sampled every period and,
+ * instead of its readings, sends one KNOT_MSG_DATA_AGGREGATE per window:
+ * sensor_id and a knot_data_aggregate of the samples taken. min, max and
+ * mean are value * 10^-decimals, with as many decimals (up to 6) as fit
+ * in 32 bits. For bool items the mean is the fraction of true samples.
+ * Aggregates are never batched nor compacted.
+ */
+#ifndef KNOT_MSG_DATA_AGGREGATE
+#define KNOT_MSG_DATA_AGGREGATE		0x64
+#endif
+
+typedef struct __attribute__ ((packed)) {
+	uint16_t		count;		// Samples in the window
+	uint8_t			decimals;
+	int32_t			min;
+	int32_t			max;
+	int32_t			mean;
+} knot_data_aggregate;
+
+/*
+ * Store and forward: readings taken while the GW was unreachable are
+ * logged (see KNOT_THING_LOG_SIZE) and uploaded later, oldest first, as
+ * KNOT_MSG_DATA_LOG frames. type and the payload are those of the
+ * original frame (KNOT_MSG_DATA or KNOT_MSG_DATA_AGGREGATE). age is the
+ * time in ms since the reading was taken, KNOT_LOG_AGE_UNKNOWN if it was
+ * logged before the thing restarted.
+ */
+#ifndef KNOT_MSG_DATA_LOG
+#define KNOT_MSG_DATA_LOG		0x65
+#endif
+
+#define KNOT_LOG_AGE_UNKNOWN		0xffffffff
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header		hdr;
+	uint32_t		age;		// ms
+	uint8_t			type;
+	uint8_t			sensor_id;
+	knot_data		payload;
+} knot_msg_data_log;
+
+/*
+ * Diagnostics: the GW sends KNOT_MSG_GET_DIAG and the thing answers
+ * KNOT_MSG_DIAG_RESP with the counters of its state machine. A request
+ * with a sensor_id is answered with KNOT_MSG_DIAG_ITEM_RESP, the counters
+ * of that data item (result is KNOT_INVALID_DATA if there is none).
+ * Counters start at 0 on init and wrap around, so the GW should look at
+ * the difference between two requests.
+ */
+#ifndef KNOT_MSG_GET_DIAG
+#define KNOT_MSG_GET_DIAG		0x66
+#endif
+#ifndef KNOT_MSG_DIAG_RESP
+#define KNOT_MSG_DIAG_RESP		0x67
+#endif
+#ifndef KNOT_MSG_DIAG_ITEM_RESP
+#define KNOT_MSG_DIAG_ITEM_RESP		0x68
+#endif
+
+/* knot_thing_protocol_stats.state of a thing online */
+#define KNOT_THING_STATE_ONLINE		6
+
+struct __attribute__ ((packed)) knot_thing_protocol_stats {
+	uint32_t		tx_frames;
+	uint32_t		tx_bytes;
+	uint32_t		rx_frames;
+	uint32_t		rx_bytes;
+	uint16_t		tx_busy;	// Link busy (-EAGAIN)
+	uint16_t		tx_errors;
+	uint16_t		connects;	// Connections accepted
+	uint16_t		errors;		// Times in STATE_ERROR
+	uint16_t		rejects;	// Requests rejected by the GW
+	uint16_t		state_changes;
+	uint16_t		readings;	// Readings queued
+	uint16_t		coalesced;	// Replaced by a newer one in the queue
+	int8_t			last_error;	// -errno, 0 if none yet
+	uint8_t			state;
+};
+
+struct __attribute__ ((packed)) knot_thing_item_stats {
+	uint16_t		samples;	// Sensor reads
+	uint16_t		read_errors;	// Read callback failures
+	uint16_t		events;		// Readings reported
+	uint16_t		writes;		// Values set by the GW
+	uint16_t		write_errors;	// Write callback failures
+};
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header		hdr;
+	uint8_t			sensor_id;
+} knot_msg_get_diag;
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header			hdr;
+	struct knot_thing_protocol_stats	stats;
+} knot_msg_diag;
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header			hdr;
+	int8_t				result;
+	uint8_t				sensor_id;
+	struct knot_thing_item_stats	stats;
+} knot_msg_diag_item;
+
+/*
+ * Streaming: blobs larger than a frame (spectra, images, logs) are sent
+ * as a sequence of KNOT_MSG_DATA_STREAM fragments. Fragments of a blob
+ * share the stream number, which changes from one blob to the next, and
+ * are numbered by seq from 0; the last one is flagged with
+ * KNOT_STREAM_FLAG_LAST and may be empty. Fragments flagged with
+ * KNOT_STREAM_FLAG_LZ hold LZF compressed data, compressed on their own
+ * so each one can be expanded as it comes: literal runs (control byte
+ * below 32, run length - 1) and back references (length - 2 in the top 3
+ * bits of the control byte, 7 meaning a length byte follows, then the
+ * distance - 1 in the low 5 bits and the next byte). Fragments are not
+ * resent: a receiver missing one drops the blob. A KNOT_MSG_GET_DATA of a
+ * stream item is answered with an empty KNOT_MSG_DATA and starts a blob.
+ */
+#ifndef KNOT_MSG_DATA_STREAM
+#define KNOT_MSG_DATA_STREAM		0x69
+#endif
+
+#define KNOT_STREAM_FLAG_LZ		0x01
+#define KNOT_STREAM_FLAG_LAST		0x80
+
+#define KNOT_STREAM_DATA_MAX		64
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header		hdr;
+	uint8_t			sensor_id;
+	uint8_t			stream;
+	uint16_t		seq;
+	uint8_t			flags;		// KNOT_STREAM_FLAG_*
+	uint8_t			data[KNOT_STREAM_DATA_MAX];
+} knot_msg_data_stream;
+
+#define KNOT_STREAM_HDR_LEN		(sizeof(knot_msg_data_stream) - \
+						KNOT_STREAM_DATA_MAX)
+
+/*
+ * Schema acks: a KNOT_MSG_SCHEMA_RESP or KNOT_MSG_SCHEMA_END_RESP whose
+ * payload is longer than the result carries the acked sensor_id right
+ * after it. Acks without it are matched to the schemas in the order they
+ * were sent.
+ */
+
+struct knot_thing_protocol;
+
+/*
+ * Callbacks into the data items layer. They get the protocol context
+ * that calls them, which the data items layer embeds in its own.
+ */
+typedef int (*data_function)(struct knot_thing_protocol *proto,
+				uint8_t sensor_id, knot_msg_data *data);
+typedef int (*schema_function)(struct knot_thing_protocol *proto,
+				uint8_t sensor_id, knot_msg_schema *schema);
+typedef int (*config_function)(struct knot_thing_protocol *proto,
+				uint8_t sensor_id, uint8_t event_flags,
+				knot_value_types *lower_limit,
+				knot_value_types *upper_limit,
+				knot_config_filter *filter);
+typedef int (*events_function)(struct knot_thing_protocol *proto,
+				knot_msg_data *data);
+/*
+ * Writes the compact encoding of data (flags byte and varints, or byte
+ * ranges for raw values) to buffer and returns its length, or 0 if the
+ * reading must be sent in full. A NULL data forgets every reference
+ * value, forcing full readings again.
+ */
+typedef int (*encode_function)(struct knot_thing_protocol *proto,
+			knot_msg_data *data, uint8_t *buffer, uint8_t len);
+
+/* Returns the schema fingerprint, updated as data items are registered */
+typedef uint32_t (*fingerprint_function)(struct knot_thing_protocol *proto);
+
+/*
+ * Returns the time (ms) until the next data item is due to be sampled, 0
+ * if one is due already or -1 if none is scheduled
+ */
+typedef int32_t (*next_function)(struct knot_thing_protocol *proto);
+
+/* Reads the counters of a data item, returns < 0 if there is none */
+typedef int (*diag_function)(struct knot_thing_protocol *proto,
+		uint8_t sensor_id, struct knot_thing_item_stats *stats);
+
+/*
+ * Builds the next fragment of the blob being streamed in msg, returns < 0
+ * if there is none. It is built again until a NULL msg tells the last one
+ * built was sent.
+ */
+typedef int (*stream_function)(struct knot_thing_protocol *proto,
+					knot_msg_data_stream *msg);
+
+/*
+ * Thing identity (MAC, UUID and token) is kept in RAM only: not read
+ * from nor written to HAL storage, which is shared by every context of
+ * a process. Each start registers the thing again with a random MAC.
+ */
+#define KNOT_THING_NO_STORAGE		0x01
+
+/*
+ * Protocol state of one thing. Allocated by the caller (usually as part
+ * of a knot_thing_ctx) and only accessed through the functions below.
+ */
+struct knot_thing_protocol {
+	/* Data items layer */
+	schema_function		schemaf;
+	data_function		thing_read;
+	data_function		thing_write;
+	config_function		configf;
+	events_function		eventf;
+	encode_function		encodef;
+	fingerprint_function	fingerprintf;
+	next_function		nextf;
+	diag_function		diagf;
+	stream_function		streamf;
+
+	/*
+	 * Thing identity (MAC, UUID and token) is read from storage once
+	 * at init and kept in RAM. Storage is only written when a value
+	 * changes, to save EEPROM cycles and keep storage I/O out of the
+	 * main loop.
+	 */
+	struct nrf24_mac	mac;
+	char			uuid[KNOT_PROTOCOL_UUID_LEN];
+	char			token[KNOT_PROTOCOL_TOKEN_LEN];
+	char			device_name[KNOT_PROTOCOL_DEVICE_NAME_LEN];
+	uint8_t			flags;		// KNOT_THING_NO_STORAGE
+
+	/* Connection state machine */
+	uint8_t			enable_run;
+	uint8_t			state;
+	uint8_t			previous_state;
+	int			last_error;
+	uint8_t			retries;
+	uint8_t			backoff;
+	uint32_t		retry_at;
+	uint8_t			tx_busy;	// Consecutive runs with link busy
+	int			sock;
+	int			cli_sock;
+	uint8_t			encoding;
+
+	/*
+	 * Single RX and TX frames: requests are parsed in place in
+	 * rx_frame and responses are built directly in tx_frame, the
+	 * buffer given to hal_comm_write(). Readings are built in place
+	 * in the outbound queue. This keeps message buffers off the stack,
+	 * where they would add up with the stack used by sensor callbacks.
+	 */
+	knot_msg		rx_frame;
+	union {
+		knot_msg		msg;
+		/* Extensions that may not fit in a knot_msg */
+		knot_msg_auth_schema	auth;
+		knot_msg_data_log	data_log;
+		knot_msg_diag		diag;
+		knot_msg_diag_item	diag_item;
+		knot_msg_data_stream	stream;
+	} tx_frame;
+
+	/*
+	 * Outbound readings waiting for the link, oldest first. Readings
+	 * are built in place at the tail slot and a pending reading of the
+	 * same sensor is overwritten, so a congested link only ever carries
+	 * the newest value of each sensor and the queue never grows past
+	 * the number of distinct sensors.
+	 */
+	knot_msg_data		txq[KNOT_THING_TXQ_LEN];
+	uint8_t			txq_head;
+	uint8_t			txq_len;
+
+	/*
+	 * Schema frames sent and not acked yet, oldest first. Items below
+	 * schema_index are either acked or in the window; resend flags the
+	 * ones the GW rejected.
+	 */
+	uint8_t			schema_index;
+	uint8_t			schema_pending;
+	uint8_t			schema_outstanding;
+	struct {
+		uint8_t		index;
+		uint8_t		sensor_id;
+		uint8_t		resend;
+	} schema_window[KNOT_THING_SCHEMA_WINDOW];
+
+#if KNOT_THING_BATCH_MTU > 0
+	/* Readings waiting to be sent in a single KNOT_MSG_DATA_BATCH frame */
+	uint8_t			batch[KNOT_THING_BATCH_MTU];
+	uint8_t			batch_len;
+	uint32_t		batch_start;
+#endif
+
+	struct knot_thing_protocol_stats	stats;
+
+#if KNOT_THING_LOG_SIZE > 0
+	/* Readings taken while offline, see knot_thing_log.h */
+	struct knot_thing_log	log;
+	uint32_t		log_upload_at;
+#endif
+
+#if KNOT_THING_STREAM_FRAG_LEN > 0
+	uint8_t			streaming;	// Fragments to send
+#endif
+};
+
+int knot_thing_protocol_init(struct knot_thing_protocol *proto,
+				const char *thing_name, uint8_t flags,
+				data_function read, data_function write,
+				schema_function schema, config_function config,
+				events_function event, encode_function encode,
+				fingerprint_function fingerprint,
+				next_function next, diag_function diag,
+				stream_function stream);
+void knot_thing_protocol_exit(struct knot_thing_protocol *proto);
+
+/*
+ * Runs one step of the protocol. Returns the time (ms) until there is
+ * work to do again, at most KNOT_THING_IDLE_MAX_MS while frames from the
+ * GW may arrive, or < 0 if the protocol is not running.
+ */
+int knot_thing_protocol_run(struct knot_thing_protocol *proto);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+
+#include "include/time.h"
+#include "knot_thing_config.h"
+#include "knot_thing_trace.h"
+
+#if KNOT_THING_TRACE_LEN > 0
+
+static struct knot_thing_trace_event ring[KNOT_THING_TRACE_LEN];
+static uint16_t ring_head;		// Next event written
+static uint16_t ring_len;
+
+void knot_thing_trace(uint8_t phase, uint8_t id, uint16_t arg)
+{
+	struct knot_thing_trace_event *event = &ring[ring_head];
+
+	event->time = KNOT_THING_TRACE_CLOCK();
+	event->phase = phase;
+	event->id = id;
+	event->arg = arg;
+
+	if (++ring_head == KNOT_THING_TRACE_LEN)
+		ring_head = 0;
+	if (ring_len < KNOT_THING_TRACE_LEN)
+		ring_len++;
+}
+
+uint16_t knot_thing_trace_copy(struct knot_thing_trace_event *events,
+								uint16_t max)
+{
+	uint16_t i, pos, count = (max < ring_len ? max : ring_len);
+
+	/* The oldest of the count newest events */
+	pos = (ring_head + KNOT_THING_TRACE_LEN - count) %
+						KNOT_THING_TRACE_LEN;
+
+	for (i = 0; i < count; i++) {
+		events[i] = ring[pos];
+		if (++pos == KNOT_THING_TRACE_LEN)
+			pos = 0;
+	}
+
+	return count;
+}
+
+void knot_thing_trace_reset(void)
+{
+	ring_head = 0;
+	ring_len = 0;
+}
+
+#endif
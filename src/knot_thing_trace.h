@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#ifndef __KNOT_THING_TRACE_H__
+#define __KNOT_THING_TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "knot_thing_config.h"
+
+/*
+ * Trace points: spans (begin/end) and instants recorded in a ring of
+ * the newest KNOT_THING_TRACE_LEN events, shared by every thing of the
+ * process. With KNOT_THING_TRACE_LEN 0 the KNOT_TRACE_*() macros compile
+ * to nothing and their arguments are not evaluated. arg is what the
+ * trace point documents, e.g. a sensor_id or a frame type.
+ */
+#define KNOT_TRACE_ID_RUN		0	// knot_thing_protocol_run()
+#define KNOT_TRACE_ID_STATE		1	// Instant, arg: new state
+#define KNOT_TRACE_ID_ACCEPT		2	// hal_comm_accept()
+#define KNOT_TRACE_ID_COMM_READ		3	// hal_comm_read(), arg: type read
+#define KNOT_TRACE_ID_COMM_WRITE	4	// hal_comm_write(), arg: type
+#define KNOT_TRACE_ID_EVENTS		5	// Sampling due items
+#define KNOT_TRACE_ID_READ		6	// Read callback, arg: sensor_id
+#define KNOT_TRACE_ID_WRITE		7	// Write callback, arg: sensor_id
+#define KNOT_TRACE_ID_ASYNC		8	// Start/ready callback, arg: sensor_id
+#define KNOT_TRACE_ID_LOG		9	// Storage log append or upload
+#define KNOT_TRACE_ID_STREAM		10	// Stream fragment, arg: sensor_id
+#define KNOT_TRACE_ID_MAX		11
+
+#define KNOT_TRACE_PHASE_BEGIN		'B'
+#define KNOT_TRACE_PHASE_END		'E'
+#define KNOT_TRACE_PHASE_INSTANT	'i'
+
+struct knot_thing_trace_event {
+	uint32_t	time;		// KNOT_THING_TRACE_CLOCK(), us
+	uint8_t		phase;		// KNOT_TRACE_PHASE_*
+	uint8_t		id;		// KNOT_TRACE_ID_*
+	uint16_t	arg;
+};
+
+#if KNOT_THING_TRACE_LEN > 0
+
+void knot_thing_trace(uint8_t phase, uint8_t id, uint16_t arg);
+
+/* Copies up to max events, oldest first, and returns how many */
+uint16_t knot_thing_trace_copy(struct knot_thing_trace_event *events,
+								uint16_t max);
+void knot_thing_trace_reset(void);
+
+#define KNOT_TRACE_BEGIN(_id, _arg)					\
+	knot_thing_trace(KNOT_TRACE_PHASE_BEGIN, (_id), (_arg))
+#define KNOT_TRACE_END(_id, _arg)					\
+	knot_thing_trace(KNOT_TRACE_PHASE_END, (_id), (_arg))
+#define KNOT_TRACE_INSTANT(_id, _arg)					\
+	knot_thing_trace(KNOT_TRACE_PHASE_INSTANT, (_id), (_arg))
+
+#else
+
+static inline uint16_t knot_thing_trace_copy(
+			struct knot_thing_trace_event *events, uint16_t max)
+{
+	return 0;
+}
+
+static inline void knot_thing_trace_reset(void)
+{
+
+}
+
+#define KNOT_TRACE_BEGIN(_id, _arg)	do { } while (0)
+#define KNOT_TRACE_END(_id, _arg)	do { } while (0)
+#define KNOT_TRACE_INSTANT(_id, _arg)	do { } while (0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __KNOT_THING_TRACE_H__ */